@@ -6,6 +6,32 @@
 	See the file COPYING.
 
 	gcc -Wall `pkg-config fuse --cflags --libs` cs1550.c -o cs1550
+
+	lseek (SEEK_HOLE/SEEK_DATA) needs FUSE 3.8 or newer:
+	gcc -Wall -DFUSE_USE_VERSION=38 `pkg-config fuse3 --cflags --libs` cs1550.c -o cs1550
+
+	The inode based low-level API instead of the path API (FUSE 3 only):
+	gcc -Wall -DCS1550_LOWLEVEL -DFUSE_USE_VERSION=38 `pkg-config fuse3 --cflags --libs` cs1550.c -o cs1550
+
+	File data striped across several images of the same size, with the
+	metadata on the first one (the list and stripe unit are fixed when the
+	first image is formatted):
+	./cs1550 -o images=/disk0/img:/disk1/img,stripe=65536 mountpoint
+
+	Fragmented files are made contiguous in the background, a pass at a time.
+	A pass starts at mount with -o defrag, or whenever CS1550_IOC_DEFRAG is
+	sent to any file (not in a -DFUSE_USE_VERSION=26 build, FUSE 2.6 has no
+	ioctl); -o defrag_rate= caps how many blocks a second it moves:
+	./cs1550 -o defrag,defrag_rate=1024 mountpoint
+
+	The images can be held in memory (huge pages where there are any), with
+	changed blocks written back every -o checkpoint= seconds (5 without it,
+	0 for only at fsync and unmount), at fsync and at unmount:
+	./cs1550 -o ram,checkpoint=30 mountpoint
+
+	Every call can be recorded with -o trace=file, and replayed by the same
+	source built as a replay tool (see TRACE REPLAY at the end):
+	gcc -Wall -DCS1550_REPLAY `pkg-config fuse --cflags --libs` cs1550.c -o cs1550-replay
 */
 
 /*
@@ -17,9 +43,32 @@
  * Fuse Filesystem Implementation
  */
 
-#define	FUSE_USE_VERSION 26
+//2.8 for ioctl, which starts the defragmenter
+#ifndef FUSE_USE_VERSION
+#define	FUSE_USE_VERSION 28
+#endif
+
+//SEEK_HOLE and SEEK_DATA
+#define _GNU_SOURCE
+
+#if defined(CS1550_LOWLEVEL) && FUSE_USE_VERSION < 30
+#error "the low-level API build needs FUSE 3 (-DFUSE_USE_VERSION=30 or newer)"
+#endif
+
+#if defined(CS1550_LOWLEVEL) && defined(CS1550_REPLAY)
+#error "traces are recorded and replayed through the path API, drop -DCS1550_LOWLEVEL"
+#endif
+
+//lseek (SEEK_DATA/SEEK_HOLE) only reaches filesystems from FUSE 3.8 on;
+//below that the kernel answers it and treats the whole file as data
+#if FUSE_USE_VERSION >= 38
+#define CS1550_LSEEK
+#endif
 
 #include <fuse.h>
+#ifdef CS1550_LOWLEVEL
+#include <fuse_lowlevel.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -27,69 +76,163 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#ifdef CS1550_REPLAY
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#endif
+
+//size of a disk block, any power of two from 4 KB to 64 KB. It is recorded
+//in block 0 when an image is formatted, and an image only mounts with the
+//block size it was formatted with.
+#ifndef BLOCK_SIZE
+#define	BLOCK_SIZE 4096
+#endif
+
+_Static_assert(BLOCK_SIZE >= 4096 && BLOCK_SIZE <= 65536 && (BLOCK_SIZE & (BLOCK_SIZE - 1)) == 0,
+	"BLOCK_SIZE must be a power of two from 4 KB to 64 KB");
+
+//size of .disk (dd bs=1K count=5K)
+#ifndef DISK_SIZE
+#define DISK_SIZE (5 * 1024 * 1024)
+#endif
+
+//one bit for every block on the disk
+#define BITMAP_SIZE ((DISK_SIZE / BLOCK_SIZE + 7) / 8)
+
+//names can be as long as on most unix filesystems
+#define	MAX_NAME 255
+
+//How many bytes of entries fit in one directory leaf block?
+#define	LEAF_BYTES (BLOCK_SIZE - 2 * sizeof(unsigned int) - sizeof(long))
 
-//150 bytes is 1200 bits which can represent ~4.9 MB
-#define BITMAP_SIZE 150
+//How many keys fit in one directory index block?
+#define	MAX_KEYS_IN_INDEX (BLOCK_SIZE - 2 * sizeof(unsigned int) - sizeof(long)) / \
+	(sizeof(unsigned int) + sizeof(long))
 
-//size of a disk block
-#define	BLOCK_SIZE 512
+//How deep a directory's index can get. Index blocks are at least 340-way,
+//so the disk runs out long before the levels do.
+#define MAX_DIR_DEPTH 8
 
-//we'll use 8.3 filenames
-#define	MAX_FILENAME 8
-#define	MAX_EXTENSION 3
+//How much data can one block hold? All of it: data blocks carry no header,
+//so file offsets map straight onto block (and page) boundaries.
+#define	MAX_DATA_IN_BLOCK BLOCK_SIZE
 
-//How many files can there be in one directory?
-#define	MAX_FILES_IN_DIR (BLOCK_SIZE - (MAX_FILENAME + 1) - sizeof(int)) / \
-	((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+/*
+ * A directory entry as stored in a leaf: this header followed by nameLen
+ * bytes of name (no nul). Entries are packed back to back, so short names
+ * take up less room than long ones.
+ */
+struct cs1550_dirent_header
+{
+	unsigned int hash;		//name_hash(name), leaves are sorted by it
+	unsigned int mode;		//S_IFDIR or S_IFREG plus permissions
+	size_t fsize;			//file size (0 for directories)
+	long nStartBlock;		//where the inode (or the directory's first block) is
+	unsigned char nameLen;	//how many bytes of name follow
+} __attribute__((packed));
+
+typedef struct cs1550_dirent_header cs1550_dirent_header;
 
-//How much data can one block hold?
-#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE - sizeof(unsigned long))
+//How many entries can one leaf hold at most (with one character names)?
+#define	MAX_FILES_IN_LEAF (LEAF_BYTES / (sizeof(cs1550_dirent_header) + 1))
 
-struct cs1550_directory_entry
+/*
+ * A directory is a B+tree keyed by a hash of the name. Its first block never
+ * moves (the parent points at it) and starts out as a single leaf. When the
+ * root splits it turns into an index block over two new blocks.
+ */
+struct cs1550_directory_leaf
 {
-	int nFiles;	//How many files are in this directory.
-				//Needs to be less than MAX_FILES_IN_DIR
+	unsigned int magic_number;	//DIR_LEAF_MAGIC
+	unsigned int nFiles;		//How many entries are in this leaf
+	long nNextLeaf;				//next leaf in hash order, 0 for the last one
 
-	struct cs1550_file_directory
-	{
-		char fname[MAX_FILENAME + 1];	//filename (plus space for nul)
-		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
-		size_t fsize;					//file size
-		long nStartBlock;				//where the first block is on disk
-	} __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
+	char entries[LEAF_BYTES];	//nFiles packed entries, sorted by hash
+} ;
+
+typedef struct cs1550_directory_leaf cs1550_directory_leaf;
+
+//A directory entry unpacked from a leaf
+struct cs1550_file_directory
+{
+	unsigned int hash;
+	unsigned int mode;
+	size_t fsize;
+	long nStartBlock;
+	char name[MAX_NAME + 1];	//name (plus space for nul)
+};
+
+typedef struct cs1550_file_directory cs1550_file_directory;
+
+struct cs1550_directory_index
+{
+	unsigned int magic_number;	//DIR_INDEX_MAGIC
+	unsigned int nKeys;			//How many keys are in use, there is one more child
+
+	long children[MAX_KEYS_IN_INDEX + 1];	//index or leaf blocks below this one
+	unsigned int keys[MAX_KEYS_IN_INDEX];	//keys[i] is the lowest hash under children[i+1]
 
 	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+	//Don't use it for anything.
+	char padding[BLOCK_SIZE - (MAX_KEYS_IN_INDEX + 1) * sizeof(long) - MAX_KEYS_IN_INDEX * sizeof(unsigned int) - 2 * sizeof(unsigned int)];
 } ;
 
-typedef struct cs1550_directory_entry cs1550_directory_entry;
+typedef struct cs1550_directory_index cs1550_directory_index;
 
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+//Either kind of directory block; the magic number says which one it is
+union cs1550_directory_node
+{
+	cs1550_directory_leaf leaf;
+	cs1550_directory_index index;
+};
+
+typedef union cs1550_directory_node cs1550_directory_node;
+
+#define DIR_LEAF_MAGIC 0xD1F1EAF1
+#define DIR_INDEX_MAGIC 0xD1F1DE00
+
+_Static_assert(sizeof(cs1550_directory_leaf) == BLOCK_SIZE, "leaf must fill exactly one block");
+_Static_assert(sizeof(cs1550_directory_index) == BLOCK_SIZE, "index must fill exactly one block");
+_Static_assert(sizeof(cs1550_dirent_header) + MAX_NAME <= LEAF_BYTES, "a leaf must fit the longest name");
 
 struct cs1550_root_directory
 {
-	int nDirectories;	//How many subdirectories are in the root
-						//Needs to be less than MAX_DIRS_IN_ROOT
-	struct cs1550_directory
-	{
-		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
-		long nStartBlock;				//where the directory block is on disk
-	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
+	//The first 8 bytes will be the value 0xC51550F6 once the image is set up
+	unsigned long magic_number;
+	long nDirectoryTree;	//where the root directory starts
+	long nOrphanBlock;		//where the orphan list is on disk
+	long nBlockSize;		//BLOCK_SIZE of the build that formatted the image
+	long nMembers;			//how many images data is striped across (0 is 1)
+	long nStripeBlocks;		//blocks per stripe unit
+	unsigned long nImageId;	//random, tags the other images as belonging here
+	long nFreeBlocks;		//free_blocks as of the last clean unmount
+	long nUsedInodes;		//used_inodes as of the last clean unmount
+	long nClean;			//1 after a clean unmount, 0 while mounted
 
 	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+	//Don't use it for anything.
+	char padding[BLOCK_SIZE - 2 * sizeof(unsigned long) - 8 * sizeof(long)];
 } ;
 
 typedef struct cs1550_root_directory cs1550_root_directory;
 
+_Static_assert(sizeof(cs1550_root_directory) == BLOCK_SIZE, "root must fill exactly one block");
+
+#define ROOT_MAGIC 0xC51550F6
+
 struct cs1550_disk_block
 {
-	//The first 4 bytes will be the value 0xF113DA7A 
-	unsigned long magic_number;
-	//And all the rest of the space in the block can be used for actual data
-	//storage.
+	//The whole block can be used for actual data storage. What a block is
+	//used for is only known from the inode pointing at it.
 	char data[MAX_DATA_IN_BLOCK];
 };
 
@@ -98,6 +241,10 @@ typedef struct cs1550_disk_block cs1550_disk_block;
 //How many pointers in an inode?
 #define NUM_POINTERS_IN_INODE (BLOCK_SIZE - sizeof(unsigned int) - sizeof(unsigned long))/sizeof(unsigned long)
 
+//How big can a file get? A null pointer in an inode is a hole that reads as
+//zeros, so a file can be this big without using this many blocks.
+#define MAX_FILE_SIZE ((off_t) (NUM_POINTERS_IN_INODE * MAX_DATA_IN_BLOCK))
+
 struct cs1550_inode
 {
 	//The first 4 bytes will be the value 0xFFFFFFFF
@@ -110,891 +257,6451 @@ struct cs1550_inode
 
 typedef struct cs1550_inode cs1550_inode;
 
-/******************************************************************************
- *
- *  HELPER FUNCTIONS BELOW
- *
- *****************************************************************************/
+//How many unlinked inodes can wait for their blocks to be freed?
+#define MAX_ORPHANS (BLOCK_SIZE - sizeof(unsigned long) - sizeof(long)) / sizeof(long)
 
-/*
- * retrieves first block from .disk
- * returns 1 on success -1 on failure
- */
-static int get_root(cs1550_root_directory *root) {
-	int value;
+struct cs1550_orphan_list
+{
+	//The first 8 bytes will be the value 0x0E9A0E9A
+	unsigned long magic_number;
+	//How many inodes are waiting for the reclaimer
+	long nOrphans;
+	//Where each orphaned inode is on disk. The inode still holds its block
+	//list, so after a crash the reclaimer can finish what it started.
+	long inodes[MAX_ORPHANS];
+};
 
-	FILE *f = fopen(".disk", "rb");
-	value = fread(root, sizeof(cs1550_root_directory), 1, f);
-	fclose(f);
-	return value;	
-}
-/*
- * goes to index block of .disk to read in a directory
- * returns 1 on success -1 on failure
- */
-static int get_directory(cs1550_directory_entry *directory, int start_block) {
-	int value = -1;
-	int seek;
-	FILE *f = fopen(".disk", "rb");
-	if(f == NULL) {
-		return value;
-	}
-	seek = fseek(f, start_block, SEEK_SET);
-	if(seek == -1) {
-		return value;
-	}
-	//value is -1 on failure
-	value = fread(directory, sizeof(cs1550_directory_entry), 1, f);
-	fclose(f);
-	return value;
-}
+typedef struct cs1550_orphan_list cs1550_orphan_list;
 
-/*
- * searches through root directory contained in block 0 of .disk
- * return index of directory, -1 on failure
- */
-static int find_directory(char *directory) {
-	cs1550_root_directory root;
-	long startBlock = -1;
-	int i, value;
-	int found = 0;
+#define ORPHAN_MAGIC 0x0E9A0E9A
 
-	value = get_root(&root);
-	if(value == -1) {
-		return value;
-	}
-	//search through subdirectories
-	for(i = 0; i < root.nDirectories && !found; i++) {
-		if(strcmp(root.directories[i].dname, directory) == 0) {
-			startBlock = root.directories[i].nStartBlock;
-			found = 1;
-		}
-	}
+//How long the reclaimer lets unlinks pile up before freeing a batch
+#define RECLAIM_DELAY_MS 50
 
-	return (int) startBlock;	
-}
+//How many blocks each allocation group covers
+#define GROUP_BLOCKS 128
+#define GROUP_BYTES (GROUP_BLOCKS / 8)
+#define NUM_GROUPS ((BITMAP_SIZE + GROUP_BYTES - 1) / GROUP_BYTES)
 
 /*
- * searches through free space structure
- * returns free block contents can be written to
- * can never return first of last block 
- * (1 and 10240)
+ * An allocation group: a slice of the bitmap with its own lock, so threads
+ * allocating in different groups never wait on each other.
  */
-static int allocate_block(void) {
-	int block = -1;
-	FILE *f = fopen(".disk", "rb+");
-	fseek(f, 0, SEEK_END);
-	int disk_size = ftell(f);
-	int offset = disk_size - BITMAP_SIZE;
-	rewind(f);
-	fseek(f, offset, SEEK_SET);
-	char *buf = (char *) malloc(BITMAP_SIZE);
-	fread(buf, BITMAP_SIZE, 1, f);
-	fclose(f);
+struct cs1550_alloc_group
+{
+	pthread_mutex_t lock;	//guards the group's bytes of bitmap and nFree
+	int nFree;				//free blocks left, read without the lock as a hint
+};
 
-	int i;
-	int j;
-	unsigned char c;
-	unsigned char comparison = 128;
-	unsigned char temp;
-	int found = 0;
-	for(i = 0; i < BITMAP_SIZE && !found; i++) {
-		c = buf[i];
-		//if byte has free space in bitmap
-		if(c != 0xff) {
-			for(j = 0; j < 8; j++) {
-				temp = c;
-				temp &= comparison;
-				if(temp != 0) {
-					comparison = comparison >> 1;
-				}
-				else {
-					//calculates block based on bitmap
-					block = 1 + j + i * 8;
-					if(block == 1) {
-						comparison = comparison >> 1;
-						block = -1;
-						continue;
-					}
-					//check that block isn't last block, saved for bitmap
-					else if(block == (disk_size / BLOCK_SIZE)) {
-						block = -1;
-						return block;
-					}
-					else {
-						found = 1;
-						break;
-					}
-				}
-			}
-			comparison = 128;
-		}
-	}
-	free(buf);
+static struct cs1550_alloc_group groups[NUM_GROUPS] = {
+	[0 ... NUM_GROUPS - 1] = { PTHREAD_MUTEX_INITIALIZER, 0 }
+};
 
-	return block;
-}
+//In-memory copy of the bitmap, loaded at mount and written through
+static unsigned char bitmap[BITMAP_SIZE];
+static long bitmap_offset = 0;	//where the bitmap is in .disk
+static int last_block = 0;		//highest block that can be allocated
 
-/*
- * update contents of bitmap
- * choice: allocate or free
- */
-static void update_bitmap(const char *choice, int block_index) {
-	FILE *f = fopen(".disk", "rb+");
-	fseek(f, 0, SEEK_END);
-	int disk_size = ftell(f);
-	int offset = disk_size - BITMAP_SIZE;
-	rewind(f);
-	fseek(f, offset, SEEK_SET);
-	char *buf = (char *) malloc(BITMAP_SIZE);
-	fread(buf, BITMAP_SIZE, 1, f);
-	int byte_index = (int) ((block_index + 8 - 1) / 8);
-	int bit_offset = (block_index-1) % 8;
-	unsigned char update = buf[byte_index-1];
-
-	if(strcmp(choice, "allocate") == 0) {
-		// we | the bit with 1
-		unsigned char updateValue = 128;
-		updateValue = (updateValue >> bit_offset) | (updateValue << (8 - bit_offset));
-		update |= updateValue; 
-	}
-	if(strcmp(choice, "free") == 0) {
-		// we & the bit with 0
-		unsigned char updateValue = 127;
-		updateValue = (updateValue >> bit_offset) | (updateValue << (8 - bit_offset));
-		update &= updateValue;
-	}
-
-	buf[byte_index-1] = update;
-	//write updated value back to disk
-	rewind(f);
-	fseek(f, offset, SEEK_SET);
-	fwrite(buf, BITMAP_SIZE, 1, f);
-	fclose(f);
-	//free bitmap buffer
-	free(buf);
-}
+//What statfs answers from, kept up to date by every allocation and free
+static long free_blocks = 0;	//every group's nFree added up
+static long used_inodes = 0;	//files and directories, the root included
 
-/*
- * searches the given directory for a specific file
- * returns -1 on failure, file index on success
- */
-static int find_file(cs1550_directory_entry *cur_directory, char *filename, char *extension) {
-	cs1550_directory_entry directory;
-	directory = *cur_directory;
-	//check if file exists
-	int i; 
-	for(i = 0; i < directory.nFiles; i++) {
-		if(strcmp(directory.files[i].fname, filename) == 0) {
-			if(strcmp(directory.files[i].fext, extension) == 0) {
-				//file index in directory
-				return i;
-			}	
-		}
-	}
+//The group a thread allocates from when there is nothing to be near
+static __thread int home_group = -1;
+static int next_home_group = 0;
 
-	return -1;
-}
-/*
- * finds data block on disk
- * returns 1 on success, -1 on failure
- */
-static int get_disk_block(cs1550_disk_block* cur_disk_block, int start_block) {
-	FILE *f = fopen(".disk", "rb+");
-	fseek(f, start_block, SEEK_SET);
-	int result = fread(cur_disk_block, sizeof(cs1550_disk_block), 1, f);
-	fclose(f);
-	return result;
-}
+//What fsync and fsyncdir make durable, chosen with -o durability=
+enum cs1550_durability
+{
+	DURABILITY_NONE,		//nothing, they return right away
+	DURABILITY_METADATA,	//the filesystem's own blocks, file data is left to the kernel
+	DURABILITY_FULL			//everything, down through the device's write cache
+};
 
-/******************************************************************************
- *
- *  END OF HELPER FUNCTIONS
- *
- *****************************************************************************/
+static enum cs1550_durability durability = DURABILITY_FULL;
 
-/*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not. 
- *
- * man -s 2 stat will show the fields of a stat structure
- */
-static int cs1550_getattr(const char *path, struct stat *stbuf)
+//Blocks written since the last sync, guarded by dirty_lock. Both are
+//tracked per block (one bit each), so metadata can be written back on its
+//own and a file's data without anyone else's.
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char dirty_meta[BITMAP_SIZE + 1];
+static unsigned char dirty_data[BITMAP_SIZE + 1];
+static int dirty_bitmap = 0;	//the bitmap at the end of .disk
+
+//How many backing images data can be striped across
+#define MAX_MEMBERS 16
+
+//Stripe unit when an image is formatted without -o stripe=
+#define DEFAULT_STRIPE_BYTES (64 * 1024)
+
+//Block 0 of every image but the first, which has the root there instead
+struct cs1550_member_header
 {
-	cs1550_directory_entry cur_directory;
-	char directory[MAX_FILENAME+1];
-	char filename[MAX_FILENAME+1];
-	char extension[MAX_EXTENSION+1];
-	int directory_block;
-	int dir_found;
-	int found = 0;
-	int res = 0;
+	unsigned long magic_number;	//MEMBER_MAGIC
+	unsigned long nImageId;		//nImageId of the first image's block 0
+	long nIndex;				//which member this is, in -o images= order
+};
 
-	memset(stbuf, 0, sizeof(struct stat));
-	//is path the root dir?
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-	} 
-	else {
+typedef struct cs1550_member_header cs1550_member_header;
 
-		//initialize directories to null character
-		directory[0] = '\0';
-		filename[0] = '\0';
-		extension[0] = '\0';
-
-		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-
-		//check if subdirectory
-		if(strcmp(directory, "\0") != 0 && strcmp(filename, "\0") == 0) {
-			directory_block = find_directory(directory);
-			if(directory_block != -1) {
-				dir_found = get_directory(&cur_directory, directory_block);
-				//if get directory fails, return error no entry
-				if(dir_found == -1) {
-					return -ENOENT;
-				}
-				else {
-					//Might want to return a structure with these fields
-					stbuf->st_mode = S_IFDIR | 0755;
-					stbuf->st_nlink = 2;
-					res = 0; //no error
-				}
-			}
-			else {
-				res = -ENOENT;
-			}
-		}
-		//regular files
-		else {
-			directory_block = find_directory(directory);
-			dir_found = get_directory(&cur_directory, directory_block);
-			int i;
-			res = -ENOENT;
-			//search through files in directory
-			//for filename and extension match
-			for(i = 0; i < cur_directory.nFiles && !found; i++) {
-				if(strcmp(cur_directory.files[i].fname, filename) == 0) {
-					if(strcmp(cur_directory.files[i].fext, extension) == 0) {
-						//regular file, probably want to be read and write
-						stbuf->st_mode = S_IFREG | 0666; 
-						stbuf->st_nlink = 1; //file links
-						stbuf->st_size = cur_directory.files[i].fsize; //file size
-						res = 0; // no error
-						found = 1;	
-					}
-				}
-			}
-		}
-	}
-	return res;
-}
+#define MEMBER_MAGIC 0xC5155057
 
-/* 
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
+struct cs1550_io_batch;
+
+/*
+ * One backing image. The first one holds all of the metadata and data
+ * blocks are spread over all of them, a stripe unit at a time. A block
+ * keeps its offset on whichever image it lands on, so every image is as
+ * big as the first (they can be sparse).
  */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
+struct cs1550_member
 {
-	//Since we're building with -Wall (all warnings reported) we need
-	//to "use" every parameter, so let's just cast them to void to
-	//satisfy the compiler
-	(void) offset;
-	(void) fi;
+	char *path;
+	int fd;						//open from mount to unmount
+	pthread_mutex_t lock;		//guards queue and stop
+	pthread_cond_t work;
+	struct cs1550_io_batch *queue;	//batches waiting for the worker, oldest first
+	struct cs1550_io_batch *tail;
+	int stop;
+	int running;
+	pthread_t worker;			//does this image's share of striped reads and writes
+	//with -o ram, the whole image in memory, NULL otherwise
+	char *ram;
+	size_t ram_length;			//bytes mapped, a whole number of huge pages
+	off_t size;					//bytes of image, never more than ram_length
+	unsigned char *dirty;		//blocks written since the last checkpoint, one bit each
+	unsigned char *pending;		//blocks the running checkpoint has yet to write
+	char **saved;				//what a pending block held when the checkpoint began,
+								//once it has been written to since
+};
 
-	cs1550_directory_entry cur_directory;
-	char directory[MAX_FILENAME+1];
-	char filename[MAX_FILENAME+1];
-	char extension[MAX_EXTENSION+1];
-	char file[(MAX_FILENAME+1) + 1 + (MAX_EXTENSION+1)];
-	int i, directory_block, dir_found;
-	int res;
+static struct cs1550_member members[MAX_MEMBERS] = {
+	[0 ... MAX_MEMBERS - 1] = { .fd = -1 }
+};
+static int num_members = 0;		//set from -o images=, or to just .disk at mount
+static long stripe_blocks = 0;	//blocks per stripe unit, 0 until mount (or -o stripe=)
 
-	//initialize directories to null character
-	directory[0] = '\0';
-	filename[0] = '\0';
-	extension[0] = '\0';
+//Where the metadata is: the first image
+static const char *image_path = ".disk";
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+//How often the checkpointer writes an image held in memory back when
+//-o checkpoint= isn't given, in seconds
+#define CHECKPOINT_SECS 5
 
-	//add contents of subdirectory
-	if (strcmp(path, "/") != 0) {
-		directory_block = find_directory(directory);
-		if(directory_block != -1) {
-			dir_found = get_directory(&cur_directory, directory_block);
-			if(dir_found == -1) {
-				return -ENOENT;
-			}
+//Anonymous memory is mapped in huge pages of this size where it can be
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
-			filler(buf, ".", NULL, 0);
-			filler(buf, "..", NULL, 0);
-			for(i = 0; i < cur_directory.nFiles; i++) {
-				//file is filename.ext
-				if(strlen(cur_directory.files[i].fext) > 0) {
-					sprintf(file, "%s.%s", cur_directory.files[i].fname, cur_directory.files[i].fext);
-				}
-				else {
-					sprintf(file, "%s", cur_directory.files[i].fname);
-				}
-				filler(buf, file, NULL, 0);
-			}
+//How many locks the blocks of an image in memory are spread over
+#define RAM_LOCKS 64
 
-			res = 0;
-		}
-		else {
-			return -ENOENT;
-		}
-	}
-	//add contents of root
-	else {
-		cs1550_root_directory root;
-		int value;
-		i = 0;
+//How many blocks in a row a checkpoint writes with one call
+#define CHECKPOINT_RUN 32
 
-		value = get_root(&root);
-		if(value == -1) {
-			return -ENOENT;
-		}
+//-o ram: every image is read into memory at mount, everything runs against
+//that, and a checkpointer writes changed blocks back behind it
+static int ram_mode = 0;
+static long checkpoint_secs = CHECKPOINT_SECS;	//-o checkpoint=, 0 for only at fsync and unmount
 
-		filler(buf, ".", NULL, 0);
-		filler(buf, "..", NULL, 0);
+//Writes to memory share ram_lock; a checkpoint takes it alone just long
+//enough to take the dirty sets, which makes them a snapshot of one instant.
+//A block's lock orders a write to it against the checkpoint copying it.
+static pthread_rwlock_t ram_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static pthread_mutex_t ram_locks[RAM_LOCKS] = {
+	[0 ... RAM_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 
-		for(i = 0; i < root.nDirectories; i++) {
-			filler(buf, root.directories[i].dname, NULL, 0);
-		}
-		res = 0;		
-	}
+//Keeps checkpoints from overlapping
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
 
-	return res;
-}
+//The checkpointer, guarded by checkpointer_lock
+static pthread_mutex_t checkpointer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_wake = PTHREAD_COND_INITIALIZER;
+static int checkpointer_running = 0;
+static int checkpointer_stop = 0;
+static pthread_t checkpointer;
+static char *checkpoint_buf = NULL;		//CHECKPOINT_RUN blocks, from mount to unmount
 
-/* 
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
+/*
+ * One block of a striped read or write: the block at start (a byte offset
+ * in the image) and the BLOCK_SIZE bytes of memory it goes to or from
  */
-static int cs1550_mkdir(const char *path, mode_t mode)
+struct cs1550_block_io
 {
-	(void) mode;
+	long start;
+	char *buf;
+};
 
-	cs1550_root_directory root;
-	//char directory[MAX_FILENAME+1];
-	char directory[20];
-	char filename[MAX_FILENAME+1];
-	char extension[MAX_EXTENSION+1];
-	int value;
-	int start_block;
+//Tracks one request until every image has done its share
+struct cs1550_io_wait
+{
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	int pending;	//batches still queued or running
+	int result;		//0, or -EIO once any batch failed
+};
 
-	//initialize directories to null character
-	directory[0] = '\0';
-	filename[0] = '\0';
-	extension[0] = '\0';
+//One image's share of a request
+struct cs1550_io_batch
+{
+	int member;
+	int write;
+	struct cs1550_block_io *ios;
+	int count;
+	struct cs1550_io_wait *wait;
+	struct cs1550_io_batch *next;
+};
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+#ifndef CS1550_LOWLEVEL
+//What a trace records, one kind per operation
+enum cs1550_trace_op
+{
+	TRACE_GETATTR = 1,
+	TRACE_READDIR,
+	TRACE_MKDIR,
+	TRACE_RMDIR,
+	TRACE_MKNOD,
+	TRACE_UNLINK,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_TRUNCATE,
+	TRACE_OPEN,
+	TRACE_FLUSH,
+	TRACE_FSYNC,
+	TRACE_FSYNCDIR,
+	TRACE_LSEEK,
+	TRACE_DROPPED,		//size records were lost because a ring was full
+	TRACE_STATFS,
+	TRACE_IOCTL,
+	TRACE_OPS
+};
 
-	if(strlen(directory) > MAX_FILENAME) {
-		return -ENAMETOOLONG;
-	}
+//The start of a trace file
+struct cs1550_trace_header
+{
+	unsigned long magic_number;	//TRACE_MAGIC
+	unsigned int nVersion;		//TRACE_VERSION
+	unsigned int nBlockSize;	//BLOCK_SIZE of the build that recorded it
+};
 
-	if(strcmp(path, "/") == 0 || strcmp(filename, "\0") != 0) {
-		return -EPERM;
-	}
-	value = find_directory(directory);
-	if(value == -1) {
-		if(directory != NULL) {
-			//check if name is valid
-			value = get_root(&root);
-			if(value == -1 || root.nDirectories >= MAX_DIRS_IN_ROOT) {
-				return -EPERM;
-			}
-			strcpy(root.directories[root.nDirectories].dname, directory);
-
-			//allocate block for new directory
-			start_block = allocate_block();
-			update_bitmap("allocate", start_block);
-			root.directories[root.nDirectories].nStartBlock = (long) (BLOCK_SIZE * start_block);
-			root.nDirectories = root.nDirectories + 1;
-			
-			//create emptry directory
-			cs1550_directory_entry new_directory;
-			new_directory.nFiles = 0;
-			FILE *f = fopen(".disk", "rb+");
-			int seek;
-			int offset = root.directories[root.nDirectories-1].nStartBlock;
-
-			//update root
-			seek = fseek(f, offset, SEEK_SET);
-			if(seek == -1) {
-				return value;
-			}
-			fwrite(&new_directory, sizeof(cs1550_directory_entry), 1, f);
-			fseek(f, 0, SEEK_SET);
-			
-			fwrite(&root, sizeof(cs1550_root_directory), 1, f);
-			fclose(f);
-		}
-	}
-	else {
-		return -EEXIST;
-	}
-	return 0;
-}
+typedef struct cs1550_trace_header cs1550_trace_header;
 
-/* 
- * Removes a directory.
- */
-static int cs1550_rmdir(const char *path)
-{
-	(void) path;
-    return 0;
-}
+#define TRACE_MAGIC 0xC51550700ACEUL
+#define TRACE_VERSION 1
 
-/* 
- * Does the actual creation of a file. Mode and dev can be ignored.
- *
+/*
+ * One call, followed in the file by pathLen bytes of path (no nul). What
+ * mode holds depends on the op: the mode for mkdir and mknod, datasync for
+ * fsync, whence for lseek, the command for ioctl.
  */
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+struct cs1550_trace_record
 {
-	(void) mode;
-	(void) dev;
-	(void) path;
-
-	cs1550_directory_entry cur_directory;
-	char directory[MAX_FILENAME+1];
-	char filename[MAX_FILENAME+1];
-	char extension[MAX_EXTENSION+1];
-	int start_block;
+	unsigned short op;			//a cs1550_trace_op
+	unsigned short pathLen;
+	unsigned int thread;		//which thread made the call, numbered from 1
+	unsigned int mode;
+	long long result;			//what the call returned
+	long long offset;
+	unsigned long long size;
+	unsigned long long start;	//nanoseconds since the mount
+	unsigned long long duration;	//nanoseconds the call took
+} __attribute__((packed));
 
-	//initialize directories to null character	
-	directory[0] = '\0';
-	filename[0] = '\0';
-	extension[0] = '\0';
-	
+typedef struct cs1550_trace_record cs1550_trace_record;
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-
-	//check if directory is root
-	if(strcmp(filename, "\0") == 0) {
-		return -EPERM;
-	}
-	//check if name is valid
-	if(strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) {
-		return -ENAMETOOLONG;
-	}
-	start_block = find_directory(directory);
-	//do I need to check if directory exists?
-	if(start_block == -1) {
-		return -ENOENT;
-	}
-	get_directory(&cur_directory, start_block);
-	//check that new file can be made
-	if(cur_directory.nFiles >= MAX_FILES_IN_DIR) {
-		return -EPERM;
-	}
-	//check if file exists
-	int i; 
-	for(i = 0; i < cur_directory.nFiles; i++) {
-		if(strcmp(cur_directory.files[i].fname, filename) == 0) {
-			if(strcmp(cur_directory.files[i].fext, extension) == 0) {
-				//file exists
-				return -EEXIST;
-			}	
-		}
-	}
-
-	//allocate a new inode
-	cs1550_inode new_inode;
-	new_inode.children = 0;
-	new_inode.magic_number = 0XFFFFFFFF;
-	int inode_block = allocate_block();
-	update_bitmap("allocate", inode_block);
-
-	//update directory
-	int fileNum = cur_directory.nFiles;
-	strcpy(cur_directory.files[fileNum].fname, filename);
-	strcpy(cur_directory.files[fileNum].fext, extension);
-	cur_directory.files[fileNum].fsize = 0;
-	cur_directory.files[fileNum].nStartBlock = (long) inode_block * BLOCK_SIZE;
-	cur_directory.nFiles = fileNum + 1;
-
-	FILE *f = fopen(".disk", "rb+");
-	int seek;
-	int offset = start_block;
-	//write directory to disk
-	seek = fseek(f, offset, SEEK_SET);
-	if(seek == -1) {
-		return seek;
-	}
-	fwrite(&cur_directory, sizeof(cs1550_directory_entry), 1, f);
-	rewind(f);
-	//write inode to disk
-	offset = cur_directory.files[fileNum].nStartBlock;
-	seek = fseek(f, offset, SEEK_SET);
-	fwrite(&new_inode, sizeof(cs1550_inode), 1, f);
-	fclose(f);
+//Longest path a trace keeps; anything longer is cut short
+#define TRACE_MAX_PATH 4095
 
-	return 0;
-}
+//How big each thread's ring is, and how often the flusher empties them
+#define TRACE_RING_BYTES (256 * 1024)
+#define TRACE_FLUSH_MS 100
 
 /*
- * Deletes a file
+ * The calls one thread has recorded that aren't in the file yet. The
+ * thread only ever moves head and the flusher only ever moves tail, so
+ * neither takes a lock.
  */
-static int cs1550_unlink(const char *path)
+struct cs1550_trace_ring
 {
-    (void) path;
-	int f_size;
+	char data[TRACE_RING_BYTES];
+	unsigned long head;		//bytes ever written into data
+	unsigned long tail;		//bytes ever written out to the file
+	unsigned long dropped;	//records that didn't fit
+	unsigned long reported;	//how many of those the file already knows about
+	unsigned int thread;
+	struct cs1550_trace_ring *next;
+};
 
-	cs1550_directory_entry cur_directory;
-	cs1550_inode inode;
-	char directory[MAX_FILENAME+1];
-	char filename[MAX_FILENAME+1];
-	char extension[MAX_EXTENSION+1];
+//Tracing for -o trace=, off while trace_file is NULL
+static FILE *trace_file = NULL;
+static struct cs1550_trace_ring *trace_rings = NULL;	//every thread's ring
+static unsigned int trace_threads = 0;
+static unsigned int trace_generation = 0;	//bumped at every mount, retiring the old rings
+static unsigned long long trace_epoch = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_wake = PTHREAD_COND_INITIALIZER;
+static int trace_running = 0;
+static int trace_stop = 0;
+static pthread_t tracer;
+#endif
 
-	//initialize directories to null character
-	directory[0] = '\0';
-	filename[0] = '\0';
-	extension[0] = '\0';
+//In-memory copy of the orphan list, guarded by orphan_lock
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t orphan_added = PTHREAD_COND_INITIALIZER;
+static cs1550_orphan_list orphans;
+static long orphan_block = 0;
+static int reclaimer_running = 0;
+static int reclaimer_stop = 0;
+static pthread_t reclaimer;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;	//held while a batch is freed
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+//Guards every directory's blocks: lookups share it, changes take it alone
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-	//read in data
-	int directory_index = find_directory(directory);
-	get_directory(&cur_directory, directory_index);
-	int index = find_file(&cur_directory, filename, extension);
-	f_size = cur_directory.files[index].fsize;
+//How many locks files' data is spread over, hashed on the inode's block
+#define FILE_LOCKS 64
 
-	//check that size is > 0
-	if(f_size < 0) {
-		return -ENOENT;
-	}
-	//check if path is a directory
-	if(strcmp(filename, "\0") == 0) {
-		return -EISDIR;
-	}
+//Guards a file's inode and block pointers: reads share it, writes,
+//truncates and the defragmenter take it alone
+static pthread_rwlock_t file_locks[FILE_LOCKS] = {
+	[0 ... FILE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
 
-	//get inode for file
-	int inode_start = cur_directory.files[index].nStartBlock;
-	//read in inode from disk
-	FILE *f = fopen(".disk", "rb+");
-	fseek(f, inode_start, SEEK_SET);
-	fread(&inode, sizeof(cs1550_inode), 1, f);
-	fclose(f); 
+//Bumped by every write and truncate under the lock, so the defragmenter
+//can tell if a file changed while it let go of the lock
+static unsigned long file_changes[FILE_LOCKS];
 
-	int i;
-	int block_index = 0;
-	//free data blocks
- 	for(i = 0; i < inode.children; i++) {
- 		block_index = ((long)inode.pointers[i]) / BLOCK_SIZE;
- 		update_bitmap("free", block_index);
- 	}
-
- 	//free inode
-	update_bitmap("free", inode_start / BLOCK_SIZE);
-
-	//update directory
-	cur_directory.nFiles = cur_directory.nFiles - 1;
-	int j;
-	for(j = index; j < cur_directory.nFiles; j++) {
-		strcpy(cur_directory.files[j].fname, cur_directory.files[j+1].fname);
-		strcpy(cur_directory.files[j].fext, cur_directory.files[j+1].fext);
-		cur_directory.files[j].fsize = cur_directory.files[j+1].fsize;
-		cur_directory.files[j].nStartBlock = cur_directory.files[j+1].nStartBlock;	
-	}	
-
-	//write updated directory
-	f = fopen(".disk", "rb+");
-	fseek(f, directory_index, SEEK_SET);
-	fwrite(&cur_directory, sizeof(cs1550_directory_entry), 1, f);
-	fclose(f);
-	  
-    return 0;
-}
+//How many of a file's blocks the defragmenter moves under one lock, and how
+//many directory entries it takes at a time
+#define DEFRAG_RUN 64
+#define DEFRAG_BATCH 64
 
-/* 
- * Read size bytes from file into buf starting from offset
+//Blocks per second the defragmenter moves when -o defrag_rate= isn't given
+#define DEFRAG_RATE 4096
+
+//What CS1550_IOC_DEFRAG_STATUS hands back
+struct cs1550_defrag_status
+{
+	unsigned int active;	//1 while a pass is running
+	unsigned int passes;	//passes finished since mount
+	unsigned long files;	//files made contiguous
+	unsigned long blocks;	//blocks moved
+};
+
+//ioctls on any file or directory: start a pass, and see how it is doing
+#define CS1550_IOC_DEFRAG _IO('C', 0x50)
+#define CS1550_IOC_DEFRAG_STATUS _IOR('C', 0x51, struct cs1550_defrag_status)
+
+//The defragmenter, guarded by defrag_lock
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_wake = PTHREAD_COND_INITIALIZER;
+static struct cs1550_defrag_status defrag_status;
+static int defrag_pending = 0;		//a pass was asked for
+static int defrag_running = 0;
+static int defrag_stop = 0;
+static pthread_t defragger;
+static int defrag_at_mount = 0;		//-o defrag
+static long defrag_rate = DEFRAG_RATE;	//-o defrag_rate=
+
+//Where the root directory starts, from block 0
+static long root_tree = 0;
+
+//How many entries the dentry cache holds
+#define DCACHE_SLOTS 4096
+
+/*
+ * One slot of the dentry cache: a directory entry and the directory it was
+ * found in. The cache is direct mapped on (directory, name hash) and every
+ * directory change writes through to it, so it never goes stale.
+ */
+struct cs1550_dentry
+{
+	long parent;	//first block of the directory holding entry, 0 if unused
+	cs1550_file_directory entry;
+};
+
+static struct cs1550_dentry dcache[DCACHE_SLOTS];
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//FUSE 3 added a flags argument to the readdir filler, which is how
+//readdirplus attributes are handed back
+#if FUSE_USE_VERSION >= 30
+#define fill_dir(filler, buf, name, stbuf, off, plus) \
+	filler(buf, name, stbuf, off, (plus) ? FUSE_FILL_DIR_PLUS : 0)
+#else
+#define fill_dir(filler, buf, name, stbuf, off, plus) filler(buf, name, stbuf, off)
+#endif
+
+//FUSE 3.5 made the ioctl command unsigned, as the kernel has it
+#if FUSE_USE_VERSION >= 35
+typedef unsigned int ioctl_cmd_t;
+#else
+typedef int ioctl_cmd_t;
+#endif
+
+//readdir offsets 1 and 2 are . and .., entries start after them
+#define READDIR_FIRST_ENTRY 3
+
+/******************************************************************************
+ *
+ *  HELPER FUNCTIONS BELOW
+ *
+ *****************************************************************************/
+
+/*
+ * notes that the block at start (a byte offset) was written, so the next
+ * fsync knows it has to be synced
+ * meta: 1 for the filesystem's own blocks, 0 for file data
+ */
+static void mark_dirty(long start, int meta) {
+	long block = start / BLOCK_SIZE;
+
+	if(durability == DURABILITY_NONE || block > BITMAP_SIZE * 8) {
+		return;
+	}
+	pthread_mutex_lock(&dirty_lock);
+	if(meta) {
+		dirty_meta[block / 8] |= 128 >> (block % 8);
+	}
+	else {
+		dirty_data[block / 8] |= 128 >> (block % 8);
+	}
+	pthread_mutex_unlock(&dirty_lock);
+}
+
+/*
+ * copies len bytes at off into image m held in memory, leaving the blocks
+ * they land in marked for the next checkpoint. A block the running
+ * checkpoint hasn't written yet is copied aside first, so that the
+ * checkpoint still writes what it held when it began.
+ * returns how many bytes were written, short at the end of the image
+ */
+static size_t ram_write(int m, const char *buf, size_t len, off_t off) {
+	struct cs1550_member *member = &members[m];
+	size_t done = 0;
+
+	if(off >= member->size) {
+		return 0;
+	}
+	if(len > (size_t) (member->size - off)) {
+		len = member->size - off;
+	}
+
+	while(done < len) {
+		long block = (off + done) / BLOCK_SIZE;
+		size_t chunk = BLOCK_SIZE - (off + done) % BLOCK_SIZE;
+		if(chunk > len - done) {
+			chunk = len - done;
+		}
+		unsigned char bit = 128 >> (block % 8);
+		pthread_mutex_t *lock = &ram_locks[block % RAM_LOCKS];
+
+		//a block at a time, so a checkpoint starting never waits on more
+		//than one block's copy (a snapshot can split a write, as a crash can)
+		pthread_rwlock_rdlock(&ram_lock);
+		pthread_mutex_lock(lock);
+		//other blocks' bits in the same byte change under their own locks
+		if((__atomic_load_n(&member->pending[block / 8], __ATOMIC_RELAXED) & bit) &&
+				member->saved[block] == NULL) {
+			char *copy = (char *) malloc(BLOCK_SIZE);
+			if(copy != NULL) {
+				memcpy(copy, member->ram + block * BLOCK_SIZE, BLOCK_SIZE);
+				member->saved[block] = copy;
+			}
+			else {
+				//no memory to keep it in: write it out now instead, which
+				//is all the checkpoint would have done with it
+				off_t start = (off_t) block * BLOCK_SIZE;
+				size_t bytes = BLOCK_SIZE;
+				if(start + (off_t) bytes > member->size) {
+					bytes = member->size - start;
+				}
+				if(pwrite(member->fd, member->ram + start, bytes, start) == (ssize_t) bytes) {
+					__sync_fetch_and_and(&member->pending[block / 8], (unsigned char) ~bit);
+				}
+			}
+		}
+		memcpy(member->ram + off + done, buf + done, chunk);
+		__sync_fetch_and_or(&member->dirty[block / 8], bit);
+		pthread_mutex_unlock(lock);
+		pthread_rwlock_unlock(&ram_lock);
+
+		done += chunk;
+	}
+
+	return len;
+}
+
+/*
+ * pread on image m, from memory with -o ram
+ */
+static ssize_t member_pread(int m, void *buf, size_t len, off_t off) {
+	struct cs1550_member *member = &members[m];
+
+	if(member->ram == NULL) {
+		return pread(member->fd, buf, len, off);
+	}
+	if(off >= member->size) {
+		return 0;
+	}
+	if(len > (size_t) (member->size - off)) {
+		len = member->size - off;
+	}
+	memcpy(buf, member->ram + off, len);
+	return len;
+}
+
+/*
+ * pwrite on image m, to memory with -o ram
+ */
+static ssize_t member_pwrite(int m, const void *buf, size_t len, off_t off) {
+	if(members[m].ram == NULL) {
+		return pwrite(members[m].fd, buf, len, off);
+	}
+	return ram_write(m, (const char *) buf, len, off);
+}
+
+/*
+ * stdio on the first image held in memory: the cookie is the position
+ */
+static ssize_t ram_file_read(void *cookie, char *buf, size_t size) {
+	off_t *pos = (off_t *) cookie;
+
+	ssize_t n = member_pread(0, buf, size, *pos);
+	*pos += n;
+	return n;
+}
+
+static ssize_t ram_file_write(void *cookie, const char *buf, size_t size) {
+	off_t *pos = (off_t *) cookie;
+
+	size_t n = ram_write(0, buf, size, *pos);
+	*pos += n;
+	return n;
+}
+
+static int ram_file_seek(void *cookie, off64_t *offset, int whence) {
+	off_t *pos = (off_t *) cookie;
+	off_t to = *offset;
+
+	if(whence == SEEK_CUR) {
+		to += *pos;
+	}
+	else if(whence == SEEK_END) {
+		to += members[0].size;
+	}
+	if(to < 0) {
+		return -1;
+	}
+	*pos = to;
+	*offset = to;
+	return 0;
+}
+
+static int ram_file_close(void *cookie) {
+	free(cookie);
+	return 0;
+}
+
+/*
+ * fopen on the first image, where the metadata is. With -o ram it is a
+ * stream over the copy in memory, buffered a block at a time (unbuffered,
+ * glibc would read it a byte at a time).
+ */
+static FILE *open_image(const char *mode) {
+	static const cookie_io_functions_t ram_file = {
+		ram_file_read, ram_file_write, ram_file_seek, ram_file_close
+	};
+
+	if(members[0].ram == NULL) {
+		return fopen(image_path, mode);
+	}
+	off_t *pos = (off_t *) calloc(1, sizeof(off_t));
+	if(pos == NULL) {
+		return NULL;
+	}
+	FILE *f = fopencookie(pos, mode, ram_file);
+	if(f == NULL) {
+		free(pos);
+		return NULL;
+	}
+	setvbuf(f, NULL, _IOFBF, BLOCK_SIZE);
+	return f;
+}
+
+/*
+ * retrieves first block from .disk
+ * returns 1 on success -1 on failure
+ */
+static int get_root(cs1550_root_directory *root) {
+	int value;
+
+	FILE *f = open_image("rb");
+	value = fread(root, sizeof(cs1550_root_directory), 1, f);
+	fclose(f);
+	return value;	
+}
+
+/*
+ * writes block 0 back to .disk
+ * returns 1 on success, 0 on failure
+ */
+static int put_root(const cs1550_root_directory *root) {
+	FILE *f = open_image("rb+");
+	int value = fwrite(root, sizeof(cs1550_root_directory), 1, f);
+	fclose(f);
+	mark_dirty(0, 1);
+	return value;
+}
+
+/*
+ * whether a block is marked used in the in-memory bitmap
+ * block k is bit k-1, most significant bit first
+ * caller holds the lock of the block's group
+ */
+static int block_used(int block) {
+	return (bitmap[(block - 1) / 8] & (128 >> ((block - 1) % 8))) != 0;
+}
+
+/*
+ * marks a block used or free in the in-memory bitmap, keeping its group's
+ * free count and free_blocks in step
+ * caller holds the lock of the block's group
+ */
+static void mark_block(int block, int used) {
+	struct cs1550_alloc_group *group = &groups[(block - 1) / GROUP_BLOCKS];
+
+	if(block_used(block) == used) {
+		return;
+	}
+	if(used) {
+		bitmap[(block - 1) / 8] |= 128 >> ((block - 1) % 8);
+		group->nFree--;
+		__sync_fetch_and_sub(&free_blocks, 1);
+	}
+	else {
+		bitmap[(block - 1) / 8] &= ~(128 >> ((block - 1) % 8));
+		group->nFree++;
+		__sync_fetch_and_add(&free_blocks, 1);
+	}
+}
+
+/*
+ * the range of blocks group g can hand out. Block 1 never is, and neither
+ * is anything that would overlap the bitmap at the end of .disk.
+ */
+static void group_range(int g, int *first, int *last) {
+	*first = g * GROUP_BLOCKS + 1;
+	if(*first < 2) {
+		*first = 2;
+	}
+	*last = (g + 1) * GROUP_BLOCKS;
+	if(*last > last_block) {
+		*last = last_block;
+	}
+}
+
+/*
+ * writes group g's slice of the bitmap back to .disk
+ * caller holds the group's lock
+ */
+static void put_group(int g) {
+	int bytes = GROUP_BYTES;
+	if((g + 1) * GROUP_BYTES > BITMAP_SIZE) {
+		bytes = BITMAP_SIZE - g * GROUP_BYTES;
+	}
+
+	FILE *f = open_image("rb+");
+	fseek(f, bitmap_offset + g * GROUP_BYTES, SEEK_SET);
+	fwrite(&bitmap[g * GROUP_BYTES], bytes, 1, f);
+	fclose(f);
+
+	if(durability != DURABILITY_NONE) {
+		pthread_mutex_lock(&dirty_lock);
+		dirty_bitmap = 1;
+		pthread_mutex_unlock(&dirty_lock);
+	}
+}
+
+/*
+ * reads the bitmap into memory at mount and counts every group's free blocks
+ * returns 0 on success, -1 on failure
+ */
+static int load_bitmap(void) {
+	int g, block, first, last;
+
+	FILE *f = open_image("rb");
+	if(f == NULL) {
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	bitmap_offset = ftell(f) - BITMAP_SIZE;
+	fseek(f, bitmap_offset, SEEK_SET);
+	int res = fread(bitmap, BITMAP_SIZE, 1, f);
+	fclose(f);
+	if(res != 1) {
+		return -1;
+	}
+
+	//the last block the bitmap describes that ends before the bitmap starts
+	last_block = BITMAP_SIZE * 8;
+	if(last_block > bitmap_offset / BLOCK_SIZE - 1) {
+		last_block = bitmap_offset / BLOCK_SIZE - 1;
+	}
+
+	free_blocks = 0;
+	for(g = 0; g < NUM_GROUPS; g++) {
+		pthread_mutex_lock(&groups[g].lock);
+		groups[g].nFree = 0;
+		group_range(g, &first, &last);
+		for(block = first; block <= last; block++) {
+			if(!block_used(block)) {
+				groups[g].nFree++;
+			}
+		}
+		free_blocks += groups[g].nFree;
+		pthread_mutex_unlock(&groups[g].lock);
+	}
+	return 0;
+}
+
+/*
+ * takes the first free block at or after goal in group g, wrapping around
+ * to the start of the group, and writes the group's bitmap slice
+ * caller holds the group's lock
+ * returns the block, -1 if the group is full
+ */
+static int take_from_group(int g, int goal) {
+	int first, last, i;
+
+	group_range(g, &first, &last);
+	if(groups[g].nFree == 0 || first > last) {
+		return -1;
+	}
+	if(goal < first || goal > last) {
+		goal = first;
+	}
+	for(i = 0; i <= last - first; i++) {
+		int block = goal + i;
+		if(block > last) {
+			block -= last - first + 1;
+		}
+		if(!block_used(block)) {
+			mark_block(block, 1);
+			put_group(g);
+			return block;
+		}
+	}
+	return -1;
+}
+
+/*
+ * searches through free space structure, marks the block it finds used and
+ * writes the bitmap
+ * near is where a related block is on disk (a file's inode or previous data
+ * block, a new entry's parent directory), 0 if there is none. The search
+ * starts right after it in its allocation group, so related blocks end up
+ * next to each other. Allocations with nothing to be near start in the
+ * calling thread's own group. A group whose lock is taken is skipped the
+ * first time around, so concurrent allocations spread out instead of
+ * queueing up.
+ * returns the block number, -1 if the disk is full
+ */
+static int allocate_block(long near) {
+	int goal = 0;
+	int home, pass, i;
+
+	if(near > 0) {
+		goal = near / BLOCK_SIZE + 1;
+		home = ((goal - 1) / GROUP_BLOCKS) % NUM_GROUPS;
+	}
+	else {
+		if(home_group == -1) {
+			home_group = __sync_fetch_and_add(&next_home_group, 1) % NUM_GROUPS;
+		}
+		home = home_group;
+	}
+
+	for(pass = 0; pass < 2; pass++) {
+		for(i = 0; i < NUM_GROUPS; i++) {
+			int g = (home + i) % NUM_GROUPS;
+			if(groups[g].nFree == 0) {
+				continue;
+			}
+			if(pass == 0) {
+				if(pthread_mutex_trylock(&groups[g].lock) != 0) {
+					continue;
+				}
+			}
+			else {
+				pthread_mutex_lock(&groups[g].lock);
+			}
+			int block = take_from_group(g, (g == home) ? goal : 0);
+			pthread_mutex_unlock(&groups[g].lock);
+			if(block != -1) {
+				return block;
+			}
+		}
+	}
+	return -1;
+}
+
+static int compare_blocks(const void *a, const void *b) {
+	return *(const int *) a - *(const int *) b;
+}
+
+/*
+ * update contents of bitmap for a batch of blocks
+ * every group the batch touches is locked and written back once, no matter
+ * how many of its blocks change
+ * choice: allocate or free
+ */
+static void update_bitmap_blocks(const char *choice, const int *blocks, int count) {
+	int used = (strcmp(choice, "allocate") == 0);
+	int i = 0;
+
+	if(count <= 0) {
+		return;
+	}
+	int *sorted = (int *) malloc(count * sizeof(int));
+	if(sorted == NULL) {
+		//no memory to sort into groups, so take them one block at a time
+		for(i = 0; i < count; i++) {
+			if(blocks[i] < 1 || blocks[i] > BITMAP_SIZE * 8) {
+				continue;
+			}
+			int g = (blocks[i] - 1) / GROUP_BLOCKS;
+			pthread_mutex_lock(&groups[g].lock);
+			mark_block(blocks[i], used);
+			put_group(g);
+			pthread_mutex_unlock(&groups[g].lock);
+		}
+		return;
+	}
+	memcpy(sorted, blocks, count * sizeof(int));
+	qsort(sorted, count, sizeof(int), compare_blocks);
+
+	while(i < count) {
+		//skip anything the bitmap doesn't describe
+		if(sorted[i] < 1 || sorted[i] > BITMAP_SIZE * 8) {
+			i++;
+			continue;
+		}
+		int g = (sorted[i] - 1) / GROUP_BLOCKS;
+		pthread_mutex_lock(&groups[g].lock);
+		while(i < count && sorted[i] <= BITMAP_SIZE * 8 && (sorted[i] - 1) / GROUP_BLOCKS == g) {
+			mark_block(sorted[i], used);
+			i++;
+		}
+		put_group(g);
+		pthread_mutex_unlock(&groups[g].lock);
+	}
+	free(sorted);
+}
+
+/*
+ * update contents of bitmap
+ * choice: allocate or free
+ */
+static void update_bitmap(const char *choice, int block_index) {
+	update_bitmap_blocks(choice, &block_index, 1);
+}
+
+/*
+ * allocates a block near another one (see allocate_block)
+ * returns where the block is on disk, -1 if the disk is full
+ */
+static long claim_block(long near) {
+	int block = allocate_block(near);
+	if(block == -1) {
+		return -1;
+	}
+	return (long) block * BLOCK_SIZE;
+}
+
+/*
+ * reads in one directory block, leaf or index
+ * returns 1 on success, 0 on failure
+ */
+static int get_dir_node(cs1550_directory_node *node, long start_block) {
+	FILE *f = open_image("rb");
+	if(f == NULL) {
+		return 0;
+	}
+	fseek(f, start_block, SEEK_SET);
+	int result = fread(node, sizeof(cs1550_directory_node), 1, f);
+	fclose(f);
+	return result;
+}
+
+/*
+ * writes a directory block back to disk
+ * returns 1 on success, 0 on failure
+ */
+static int put_dir_node(const void *node, long start_block) {
+	FILE *f = open_image("rb+");
+	fseek(f, start_block, SEEK_SET);
+	int result = fwrite(node, sizeof(cs1550_directory_node), 1, f);
+	fclose(f);
+	mark_dirty(start_block, 1);
+	return result;
+}
+
+/*
+ * 32 bit FNV-1a hash of a name, the key directories are sorted by
+ */
+static unsigned int name_hash(const char *name) {
+	unsigned int hash = 2166136261u;
+	const char *c;
+
+	for(c = name; *c != '\0'; c++) {
+		hash = (hash ^ (unsigned char) *c) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * allocates and writes an empty directory (a single empty leaf) near
+ * another block (see allocate_block)
+ * returns where the directory starts on disk, -1 if the disk is full
+ */
+static long create_directory_block(long near) {
+	cs1550_directory_leaf leaf;
+	long block = claim_block(near);
+	if(block == -1) {
+		return -1;
+	}
+	memset(&leaf, 0, sizeof(cs1550_directory_leaf));
+	leaf.magic_number = DIR_LEAF_MAGIC;
+	put_dir_node(&leaf, block);
+	return block;
+}
+
+/*
+ * how many bytes an entry takes up in a leaf
+ */
+static size_t entry_bytes(const cs1550_file_directory *entry) {
+	return sizeof(cs1550_dirent_header) + strlen(entry->name);
+}
+
+/*
+ * unpacks the entry at *p in a leaf into entry and moves *p past it
+ * returns 0 on success, -1 if the leaf is damaged
+ */
+static int leaf_next(const cs1550_directory_leaf *leaf, const char **p, cs1550_file_directory *entry) {
+	cs1550_dirent_header header;
+	const char *end = leaf->entries + LEAF_BYTES;
+
+	if(*p + sizeof(cs1550_dirent_header) > end) {
+		return -1;
+	}
+	memcpy(&header, *p, sizeof(cs1550_dirent_header));
+	*p += sizeof(cs1550_dirent_header);
+	if(header.nameLen == 0 || *p + header.nameLen > end) {
+		return -1;
+	}
+	entry->hash = header.hash;
+	entry->mode = header.mode;
+	entry->fsize = header.fsize;
+	entry->nStartBlock = header.nStartBlock;
+	memcpy(entry->name, *p, header.nameLen);
+	entry->name[header.nameLen] = '\0';
+	*p += header.nameLen;
+	return 0;
+}
+
+/*
+ * unpacks every entry in a leaf into files
+ * returns how many entries there are, -1 if the leaf is damaged
+ */
+static int leaf_unpack(const cs1550_directory_leaf *leaf, cs1550_file_directory *files) {
+	const char *p = leaf->entries;
+	unsigned int i;
+
+	if(leaf->nFiles > MAX_FILES_IN_LEAF) {
+		return -1;
+	}
+	for(i = 0; i < leaf->nFiles; i++) {
+		if(leaf_next(leaf, &p, &files[i]) == -1) {
+			return -1;
+		}
+	}
+	return leaf->nFiles;
+}
+
+/*
+ * searches a leaf's packed entries in place for a specific name, without
+ * unpacking any past it
+ * returns where the entry starts in leaf->entries and fills entry,
+ * -1 if it isn't there, -2 if the leaf is damaged
+ */
+static int leaf_find(const cs1550_directory_leaf *leaf, unsigned int hash, const char *name,
+			 cs1550_file_directory *entry) {
+	const char *p = leaf->entries;
+	unsigned int i;
+
+	if(leaf->nFiles > MAX_FILES_IN_LEAF) {
+		return -2;
+	}
+	for(i = 0; i < leaf->nFiles; i++) {
+		const char *start = p;
+		if(leaf_next(leaf, &p, entry) == -1) {
+			return -2;
+		}
+		//entries are sorted by hash
+		if(entry->hash > hash) {
+			return -1;
+		}
+		if(entry->hash == hash && strcmp(entry->name, name) == 0) {
+			return start - leaf->entries;
+		}
+	}
+	return -1;
+}
+
+/*
+ * packs entries into a leaf, keeping its magic number and next leaf
+ * returns 0 on success, -1 if they don't fit
+ */
+static int leaf_pack(cs1550_directory_leaf *leaf, const cs1550_file_directory *files, int count) {
+	cs1550_dirent_header header;
+	char *p = leaf->entries;
+	size_t total = 0;
+	int i;
+
+	for(i = 0; i < count; i++) {
+		total += entry_bytes(&files[i]);
+	}
+	if(total > LEAF_BYTES) {
+		return -1;
+	}
+
+	memset(leaf->entries, 0, LEAF_BYTES);
+	for(i = 0; i < count; i++) {
+		header.hash = files[i].hash;
+		header.mode = files[i].mode;
+		header.fsize = files[i].fsize;
+		header.nStartBlock = files[i].nStartBlock;
+		header.nameLen = strlen(files[i].name);
+		memcpy(p, &header, sizeof(cs1550_dirent_header));
+		p += sizeof(cs1550_dirent_header);
+		memcpy(p, files[i].name, header.nameLen);
+		p += header.nameLen;
+	}
+	leaf->nFiles = count;
+	return 0;
+}
+
+/*
+ * walks a directory's index from its first block down to the leaf that
+ * covers hash, remembering the blocks and child slots passed on the way
+ * caller holds dir_lock
+ * returns the depth of the leaf (0 if the directory is a single leaf),
+ * -1 if the directory is damaged
+ */
+static int find_leaf(long dir, unsigned int hash, cs1550_directory_node *node,
+			long *path, int *slots) {
+	long block = dir;
+	int depth = 0;
+
+	while(1) {
+		if(get_dir_node(node, block) != 1) {
+			return -1;
+		}
+		path[depth] = block;
+		if(node->leaf.magic_number == DIR_LEAF_MAGIC) {
+			return depth;
+		}
+		if(node->index.magic_number != DIR_INDEX_MAGIC || depth == MAX_DIR_DEPTH) {
+			return -1;
+		}
+
+		//the first key above hash tells which child covers it
+		unsigned int lo = 0;
+		unsigned int hi = node->index.nKeys;
+		while(lo < hi) {
+			unsigned int mid = (lo + hi) / 2;
+			if(node->index.keys[mid] <= hash) {
+				lo = mid + 1;
+			}
+			else {
+				hi = mid;
+			}
+		}
+		slots[depth] = lo;
+		block = node->index.children[lo];
+		depth++;
+	}
+}
+
+/*
+ * finds the first of count entries whose hash is not below hash
+ */
+static int files_lower_bound(const cs1550_file_directory *files, int count, unsigned int hash) {
+	int lo = 0;
+	int hi = count;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(files[mid].hash < hash) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * searches unpacked leaf entries for a specific name
+ * returns -1 on failure, index of the entry on success
+ */
+static int files_find(const cs1550_file_directory *files, int count, unsigned int hash,
+			const char *name) {
+	int i;
+	for(i = files_lower_bound(files, count, hash); i < count && files[i].hash == hash; i++) {
+		if(strcmp(files[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * picks the dentry cache slot for a name in a directory
+ */
+static unsigned int dcache_slot(long parent, unsigned int hash) {
+	return (hash ^ ((unsigned int) (parent / BLOCK_SIZE) * 2654435761u)) % DCACHE_SLOTS;
+}
+
+/*
+ * looks for a name in the dentry cache
+ * returns 1 and fills entry on a hit, 0 on a miss
+ */
+static int dcache_get(long parent, const char *name, unsigned int hash, cs1550_file_directory *entry) {
+	struct cs1550_dentry *dentry = &dcache[dcache_slot(parent, hash)];
+	int hit;
+
+	pthread_mutex_lock(&dcache_lock);
+	hit = dentry->parent == parent && dentry->entry.hash == hash &&
+		strcmp(dentry->entry.name, name) == 0;
+	if(hit) {
+		*entry = dentry->entry;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+	return hit;
+}
+
+/*
+ * remembers (or refreshes) a directory entry in the dentry cache
+ * caller holds dir_lock, so the cache can't race with the disk
+ */
+static void dcache_put(long parent, const cs1550_file_directory *entry) {
+	struct cs1550_dentry *dentry = &dcache[dcache_slot(parent, entry->hash)];
+
+	pthread_mutex_lock(&dcache_lock);
+	dentry->parent = parent;
+	dentry->entry = *entry;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * forgets a directory entry that was removed
+ * caller holds dir_lock
+ */
+static void dcache_drop(long parent, const cs1550_file_directory *entry) {
+	struct cs1550_dentry *dentry = &dcache[dcache_slot(parent, entry->hash)];
+
+	pthread_mutex_lock(&dcache_lock);
+	if(dentry->parent == parent && strcmp(dentry->entry.name, entry->name) == 0) {
+		dentry->parent = 0;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * looks up a name in the directory starting at dir, trying the dentry
+ * cache before reading any blocks
+ * returns 0 and fills entry on success, negative errno on failure
+ */
+static int dir_lookup(long dir, const char *name, cs1550_file_directory *entry) {
+	cs1550_directory_node node;
+	cs1550_file_directory found;
+	long path[MAX_DIR_DEPTH + 1];
+	int slots[MAX_DIR_DEPTH];
+	unsigned int hash = name_hash(name);
+	int res = -ENOENT;
+
+	if(dcache_get(dir, name, hash, entry)) {
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&dir_lock);
+	int depth = find_leaf(dir, hash, &node, path, slots);
+	int at = (depth == -1) ? -2 : leaf_find(&node.leaf, hash, name, &found);
+	if(at == -2) {
+		res = -EIO;
+	}
+	else if(at >= 0) {
+		*entry = found;
+		dcache_put(dir, entry);
+		res = 0;
+	}
+	pthread_rwlock_unlock(&dir_lock);
+	return res;
+}
+
+/*
+ * overwrites the size and start block of an existing entry
+ * returns 0 on success, negative errno on failure
+ */
+static int dir_update(long dir, const cs1550_file_directory *entry) {
+	cs1550_directory_node node;
+	cs1550_dirent_header header;
+	cs1550_file_directory found;
+	long path[MAX_DIR_DEPTH + 1];
+	int slots[MAX_DIR_DEPTH];
+	int res = -ENOENT;
+
+	pthread_rwlock_wrlock(&dir_lock);
+	int depth = find_leaf(dir, entry->hash, &node, path, slots);
+	int at = (depth == -1) ? -2 : leaf_find(&node.leaf, entry->hash, entry->name, &found);
+	if(at == -2) {
+		res = -EIO;
+	}
+	else if(at >= 0) {
+		//same name, so the entry is rewritten where it is
+		memcpy(&header, &node.leaf.entries[at], sizeof(cs1550_dirent_header));
+		header.fsize = entry->fsize;
+		header.nStartBlock = entry->nStartBlock;
+		memcpy(&node.leaf.entries[at], &header, sizeof(cs1550_dirent_header));
+		put_dir_node(&node, path[depth]);
+		found.fsize = entry->fsize;
+		found.nStartBlock = entry->nStartBlock;
+		dcache_put(dir, &found);
+		res = 0;
+	}
+	pthread_rwlock_unlock(&dir_lock);
+	return res;
+}
+
+/*
+ * removes a name from the directory starting at dir
+ * Leaves are never merged back together (as in ext4's htree), an empty leaf
+ * just stays in the index until its hash range is used again.
+ * caller holds dir_lock for writing
+ * returns 0 and fills removed on success, negative errno on failure
+ */
+static int remove_entry(long dir, const char *name, cs1550_file_directory *removed) {
+	cs1550_directory_node node;
+	long path[MAX_DIR_DEPTH + 1];
+	int slots[MAX_DIR_DEPTH];
+	unsigned int hash = name_hash(name);
+
+	int depth = find_leaf(dir, hash, &node, path, slots);
+	int at = (depth == -1) ? -2 : leaf_find(&node.leaf, hash, name, removed);
+	if(at == -2) {
+		return -EIO;
+	}
+	if(at == -1) {
+		return -ENOENT;
+	}
+	//close the gap in place, leaving zeros at the end as leaf_pack does
+	size_t bytes = entry_bytes(removed);
+	memmove(&node.leaf.entries[at], &node.leaf.entries[at + bytes], LEAF_BYTES - at - bytes);
+	memset(&node.leaf.entries[LEAF_BYTES - bytes], 0, bytes);
+	node.leaf.nFiles = node.leaf.nFiles - 1;
+	put_dir_node(&node, path[depth]);
+	dcache_drop(dir, removed);
+	return 0;
+}
+
+/*
+ * removes a name from the directory starting at dir
+ * returns 0 and fills removed on success, negative errno on failure
+ */
+static int dir_remove(long dir, const char *name, cs1550_file_directory *removed) {
+	pthread_rwlock_wrlock(&dir_lock);
+	int res = remove_entry(dir, name, removed);
+	pthread_rwlock_unlock(&dir_lock);
+	if(res == 0) {
+		__sync_fetch_and_sub(&used_inodes, 1);
+	}
+	return res;
+}
+
+//dir_insert's working space: a leaf's worth of entries and a few blocks,
+//far too big for the stack with large blocks
+struct dir_insert_space
+{
+	cs1550_directory_node node;
+	cs1550_directory_node scan;
+	cs1550_directory_leaf left_leaf, right_leaf;
+	cs1550_directory_index left_index, right_index;
+	unsigned int keys[MAX_KEYS_IN_INDEX + 1];
+	long children[MAX_KEYS_IN_INDEX + 2];
+	cs1550_file_directory files[MAX_FILES_IN_LEAF + 1];
+};
+
+/*
+ * adds an entry to the directory starting at dir, splitting the leaf and as
+ * many index blocks above it as needed. The directory's first block always
+ * stays put: when it has to split, its contents move into two new blocks
+ * and it becomes the index over them.
+ * returns 0 on success, negative errno on failure
+ */
+static int dir_insert(long dir, const cs1550_file_directory *entry) {
+	struct dir_insert_space *w;
+	long path[MAX_DIR_DEPTH + 1];
+	int slots[MAX_DIR_DEPTH];
+	long spare[MAX_DIR_DEPTH + 2];
+	int num_spare = 0;
+	int used = 0;
+	int depth, level, pos, n, split, i;
+	unsigned int key;
+	long left_block, right_block, child;
+
+	w = (struct dir_insert_space *) malloc(sizeof(struct dir_insert_space));
+	if(w == NULL) {
+		return -ENOMEM;
+	}
+	cs1550_file_directory *files = w->files;
+	cs1550_directory_node *node = &w->node;
+
+	pthread_rwlock_wrlock(&dir_lock);
+	depth = find_leaf(dir, entry->hash, node, path, slots);
+	n = (depth == -1) ? -1 : leaf_unpack(&node->leaf, files);
+	if(n == -1) {
+		pthread_rwlock_unlock(&dir_lock);
+		free(w);
+		return -EIO;
+	}
+	if(files_find(files, n, entry->hash, entry->name) != -1) {
+		pthread_rwlock_unlock(&dir_lock);
+		free(w);
+		return -EEXIST;
+	}
+
+	//entries with the same hash stay together, new ones go after them
+	pos = files_lower_bound(files, n, entry->hash);
+	while(pos < n && files[pos].hash == entry->hash) {
+		pos++;
+	}
+	memmove(&files[pos + 1], &files[pos], (n - pos) * sizeof(cs1550_file_directory));
+	files[pos] = *entry;
+	n++;
+	if(n <= (int) MAX_FILES_IN_LEAF && leaf_pack(&node->leaf, files, n) == 0) {
+		put_dir_node(node, path[depth]);
+		dcache_put(dir, entry);
+		pthread_rwlock_unlock(&dir_lock);
+		free(w);
+		return 0;
+	}
+
+	//the leaf is full, split it as close to half its bytes as possible but
+	//never between two entries with the same hash, since lookups only
+	//search one leaf
+	size_t total = 0;
+	size_t left = 0;
+	size_t best_diff = 0;
+	for(i = 0; i < n; i++) {
+		total += entry_bytes(&files[i]);
+	}
+	split = -1;
+	for(i = 1; i < n; i++) {
+		left += entry_bytes(&files[i - 1]);
+		if(files[i].hash == files[i - 1].hash || i > (int) MAX_FILES_IN_LEAF ||
+				n - i > (int) MAX_FILES_IN_LEAF || left > LEAF_BYTES || total - left > LEAF_BYTES) {
+			continue;
+		}
+		size_t diff = (2 * left > total) ? 2 * left - total : total - 2 * left;
+		if(split == -1 || diff < best_diff) {
+			split = i;
+			best_diff = diff;
+		}
+	}
+	if(split == -1) {
+		pthread_rwlock_unlock(&dir_lock);
+		free(w);
+		return -ENOSPC;
+	}
+
+	//claim every block the split needs up front, so running out of space
+	//can't leave the index half updated
+	int needed = (depth == 0) ? 2 : 1;
+	for(level = depth - 1; level >= 0; level--) {
+		get_dir_node(&w->scan, path[level]);
+		if(w->scan.index.nKeys < MAX_KEYS_IN_INDEX) {
+			break;
+		}
+		needed += (level == 0) ? 2 : 1;
+	}
+	for(i = 0; i < needed; i++) {
+		spare[num_spare] = claim_block(dir);
+		if(spare[num_spare] == -1) {
+			int blocks[MAX_DIR_DEPTH + 2];
+			for(i = 0; i < num_spare; i++) {
+				blocks[i] = spare[i] / BLOCK_SIZE;
+			}
+			update_bitmap_blocks("free", blocks, num_spare);
+			pthread_rwlock_unlock(&dir_lock);
+			free(w);
+			return -ENOSPC;
+		}
+		num_spare++;
+	}
+
+	memset(&w->left_leaf, 0, sizeof(cs1550_directory_leaf));
+	memset(&w->right_leaf, 0, sizeof(cs1550_directory_leaf));
+	w->left_leaf.magic_number = DIR_LEAF_MAGIC;
+	w->right_leaf.magic_number = DIR_LEAF_MAGIC;
+	leaf_pack(&w->left_leaf, files, split);
+	leaf_pack(&w->right_leaf, &files[split], n - split);
+	key = files[split].hash;
+
+	left_block = (depth == 0) ? spare[used++] : path[depth];
+	right_block = spare[used++];
+	w->right_leaf.nNextLeaf = node->leaf.nNextLeaf;
+	w->left_leaf.nNextLeaf = right_block;
+	//write the new right half first so the leaf chain never points at
+	//a block that hasn't been written yet
+	put_dir_node(&w->right_leaf, right_block);
+	put_dir_node(&w->left_leaf, left_block);
+	child = right_block;
+
+	for(level = depth - 1; level >= -1; level--) {
+		if(level == -1) {
+			//the directory's first block split: it becomes the index over
+			//the two halves that were just written
+			memset(&w->left_index, 0, sizeof(cs1550_directory_index));
+			w->left_index.magic_number = DIR_INDEX_MAGIC;
+			w->left_index.nKeys = 1;
+			w->left_index.children[0] = left_block;
+			w->left_index.children[1] = child;
+			w->left_index.keys[0] = key;
+			put_dir_node(&w->left_index, dir);
+			break;
+		}
+
+		get_dir_node(node, path[level]);
+		pos = slots[level];
+		n = node->index.nKeys;
+		if(n < (int) MAX_KEYS_IN_INDEX) {
+			memmove(&node->index.keys[pos + 1], &node->index.keys[pos], (n - pos) * sizeof(unsigned int));
+			memmove(&node->index.children[pos + 2], &node->index.children[pos + 1], (n - pos) * sizeof(long));
+			node->index.keys[pos] = key;
+			node->index.children[pos + 1] = child;
+			node->index.nKeys = n + 1;
+			put_dir_node(node, path[level]);
+			break;
+		}
+
+		//the index block is full too, split it and push the middle key up
+		memcpy(w->keys, node->index.keys, pos * sizeof(unsigned int));
+		w->keys[pos] = key;
+		memcpy(&w->keys[pos + 1], &node->index.keys[pos], (n - pos) * sizeof(unsigned int));
+		memcpy(w->children, node->index.children, (pos + 1) * sizeof(long));
+		w->children[pos + 1] = child;
+		memcpy(&w->children[pos + 2], &node->index.children[pos + 1], (n - pos) * sizeof(long));
+		n++;
+		split = n / 2;
+
+		memset(&w->left_index, 0, sizeof(cs1550_directory_index));
+		memset(&w->right_index, 0, sizeof(cs1550_directory_index));
+		w->left_index.magic_number = DIR_INDEX_MAGIC;
+		w->right_index.magic_number = DIR_INDEX_MAGIC;
+		w->left_index.nKeys = split;
+		w->right_index.nKeys = n - split - 1;
+		memcpy(w->left_index.keys, w->keys, split * sizeof(unsigned int));
+		memcpy(w->left_index.children, w->children, (split + 1) * sizeof(long));
+		memcpy(w->right_index.keys, &w->keys[split + 1], (n - split - 1) * sizeof(unsigned int));
+		memcpy(w->right_index.children, &w->children[split + 1], (n - split) * sizeof(long));
+		key = w->keys[split];
+
+		left_block = (level == 0) ? spare[used++] : path[level];
+		right_block = spare[used++];
+		put_dir_node(&w->right_index, right_block);
+		put_dir_node(&w->left_index, left_block);
+		child = right_block;
+	}
+
+	dcache_put(dir, entry);
+	pthread_rwlock_unlock(&dir_lock);
+	free(w);
+	return 0;
+}
+
+/*
+ * finds the leaf holding the lowest hashes in a directory, where a walk
+ * along the leaf chain starts
+ * caller holds dir_lock
+ * returns the leaf's block, -1 if the directory is damaged
+ */
+static long dir_first_leaf(long dir) {
+	cs1550_directory_node node;
+	long block = dir;
+	int depth;
+
+	for(depth = 0; depth <= MAX_DIR_DEPTH; depth++) {
+		if(get_dir_node(&node, block) != 1) {
+			return -1;
+		}
+		if(node.leaf.magic_number == DIR_LEAF_MAGIC) {
+			return block;
+		}
+		if(node.index.magic_number != DIR_INDEX_MAGIC) {
+			return -1;
+		}
+		block = node.index.children[0];
+	}
+	return -1;
+}
+
+/*
+ * checks every leaf of a directory for entries
+ * caller holds dir_lock
+ * returns 1 if it is empty, 0 if not, -1 if the directory is damaged
+ */
+static int dir_is_empty(long dir) {
+	cs1550_directory_node node;
+	long block = dir_first_leaf(dir);
+
+	while(block > 0) {
+		if(get_dir_node(&node, block) != 1) {
+			return -1;
+		}
+		if(node.leaf.nFiles > 0) {
+			return 0;
+		}
+		block = node.leaf.nNextLeaf;
+	}
+	return (block == 0) ? 1 : -1;
+}
+
+/*
+ * adds every block of a directory's tree (index blocks and leaves) to
+ * blocks, growing it as needed
+ * caller holds dir_lock
+ * returns 0 on success, -EIO if the directory is damaged, -ENOMEM if blocks
+ * can't grow (what was collected so far stays in it)
+ */
+static int dir_collect_blocks(long block, int depth, int **blocks, int *count, int *size) {
+	cs1550_directory_node node;
+	unsigned int i;
+	int res;
+
+	if(depth > MAX_DIR_DEPTH || get_dir_node(&node, block) != 1) {
+		return -EIO;
+	}
+	if(*count == *size) {
+		int *more = (int *) realloc(*blocks, (*size * 2 + 16) * sizeof(int));
+		if(more == NULL) {
+			return -ENOMEM;
+		}
+		*blocks = more;
+		*size = *size * 2 + 16;
+	}
+	(*blocks)[(*count)++] = block / BLOCK_SIZE;
+
+	if(node.leaf.magic_number == DIR_LEAF_MAGIC) {
+		return 0;
+	}
+	if(node.index.magic_number != DIR_INDEX_MAGIC) {
+		return -EIO;
+	}
+	for(i = 0; i <= node.index.nKeys; i++) {
+		res = dir_collect_blocks(node.index.children[i], depth + 1, blocks, count, size);
+		if(res != 0) {
+			return res;
+		}
+	}
+	return 0;
+}
+
+#ifndef CS1550_LOWLEVEL
+//paths only come in through the high-level API
+
+/*
+ * walks path from the root one component at a time, through the dentry
+ * cache so deep paths don't cost a directory read per component
+ * returns 0 and fills entry and the first block of the directory holding it
+ * (0 for the root itself) on success, negative errno on failure
+ */
+static int resolve_path(const char *path, cs1550_file_directory *entry, long *parent) {
+	char name[MAX_NAME + 1];
+	const char *p = path;
+	size_t len;
+	int res;
+
+	//the root is a directory with no parent
+	memset(entry, 0, sizeof(cs1550_file_directory));
+	entry->mode = S_IFDIR | 0755;
+	entry->nStartBlock = root_tree;
+	*parent = 0;
+
+	while(1) {
+		while(*p == '/') {
+			p++;
+		}
+		if(*p == '\0') {
+			return 0;
+		}
+		len = strcspn(p, "/");
+		if(len > MAX_NAME) {
+			return -ENAMETOOLONG;
+		}
+		if(!S_ISDIR(entry->mode)) {
+			return -ENOTDIR;
+		}
+		memcpy(name, p, len);
+		name[len] = '\0';
+
+		long dir = entry->nStartBlock;
+		res = dir_lookup(dir, name, entry);
+		if(res != 0) {
+			return res;
+		}
+		*parent = dir;
+		p += len;
+	}
+}
+
+/*
+ * resolves everything but the last component of path
+ * returns 0 and fills the parent directory's first block and the last
+ * component's name on success, negative errno on failure
+ */
+static int resolve_parent(const char *path, long *dir, char *name) {
+	cs1550_file_directory entry;
+	long grandparent;
+	size_t len = strlen(path);
+	size_t start;
+	int res;
+
+	//ignore trailing slashes
+	while(len > 1 && path[len - 1] == '/') {
+		len--;
+	}
+	start = len;
+	while(start > 0 && path[start - 1] != '/') {
+		start--;
+	}
+	//the root already exists
+	if(start == len) {
+		return -EEXIST;
+	}
+	if(len - start > MAX_NAME) {
+		return -ENAMETOOLONG;
+	}
+	memcpy(name, path + start, len - start);
+	name[len - start] = '\0';
+
+	char *parent_path = strndup(path, start);
+	if(parent_path == NULL) {
+		return -ENOMEM;
+	}
+	res = resolve_path(parent_path, &entry, &grandparent);
+	free(parent_path);
+	if(res != 0) {
+		return res;
+	}
+	if(!S_ISDIR(entry.mode)) {
+		return -ENOTDIR;
+	}
+	*dir = entry.nStartBlock;
+	return 0;
+}
+
+/*
+ * resolves a path that has to name a regular file
+ * returns 0 and fills entry and the directory holding it on success,
+ * negative errno on failure
+ */
+static int lookup_file(const char *path, cs1550_file_directory *entry, long *dir) {
+	int res = resolve_path(path, entry, dir);
+	if(res != 0) {
+		return res;
+	}
+	if(S_ISDIR(entry->mode)) {
+		return -EISDIR;
+	}
+	return 0;
+}
+#endif
+
+/*
+ * inode numbers are the block number of a file's inode (or a directory's
+ * first block). FUSE wants the root to be inode 1, which no one else can
+ * have since allocate_block never hands out block 1.
+ */
+static unsigned long block_ino(long start_block) {
+	if(start_block == root_tree) {
+		return 1;
+	}
+	return start_block / BLOCK_SIZE;
+}
+
+/*
+ * fills in a stat structure from what a directory entry already knows, so
+ * getattr and readdir never have to read the inode
+ */
+static void fill_stat(const cs1550_file_directory *entry, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = block_ino(entry->nStartBlock);
+	stbuf->st_mode = entry->mode;
+	if(S_ISDIR(entry->mode)) {
+		stbuf->st_nlink = 2;
+	}
+	else {
+		stbuf->st_nlink = 1; //file links
+		stbuf->st_size = entry->fsize; //file size
+	}
+}
+
+/*
+ * fills in statfs from the running counters, without reading anything
+ * Every free block could become a file's inode, so that's how many more
+ * files there is room for.
+ */
+static void fill_statfs(struct statvfs *stbuf) {
+	long avail = free_blocks;
+
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = (last_block > 1) ? last_block - 1 : 0;	//blocks 2 to last_block
+	stbuf->f_bfree = avail;
+	stbuf->f_bavail = avail;
+	stbuf->f_files = used_inodes + avail;
+	stbuf->f_ffree = avail;
+	stbuf->f_favail = avail;
+	stbuf->f_namemax = MAX_NAME;
+}
+
+/*
+ * a random id for a new image, so its other images can be told apart from
+ * another filesystem's
+ */
+static unsigned long new_image_id(void) {
+	unsigned long id = 0;
+
+	FILE *f = fopen("/dev/urandom", "rb");
+	if(f != NULL) {
+		if(fread(&id, sizeof(id), 1, f) != 1) {
+			id = 0;
+		}
+		fclose(f);
+	}
+	if(id == 0) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		id = ((unsigned long) now.tv_sec << 20) ^ now.tv_usec ^ ((unsigned long) getpid() << 40);
+	}
+	return id;
+}
+
+/*
+ * checks (or, formatting, writes) block 0 of every image but the first
+ * Each one has to be big enough to hold any block the bitmap can hand out.
+ * returns 0 on success, -1 if one of them is wrong
+ */
+static int check_members(const cs1550_root_directory *root, int format) {
+	cs1550_member_header header;
+	cs1550_member_header blank;
+	int m;
+
+	memset(&blank, 0, sizeof(cs1550_member_header));
+	for(m = 1; m < num_members; m++) {
+		off_t size = lseek(members[m].fd, 0, SEEK_END);
+		if(size < (off_t) (last_block + 1) * BLOCK_SIZE) {
+			fprintf(stderr, "%s is smaller than %s\n", members[m].path, image_path);
+			return -1;
+		}
+		if(member_pread(m, &header, sizeof(header), 0) != sizeof(header)) {
+			return -1;
+		}
+		if(format) {
+			if(memcmp(&header, &blank, sizeof(cs1550_member_header)) != 0) {
+				fprintf(stderr, "%s is not blank\n", members[m].path);
+				return -1;
+			}
+			header.magic_number = MEMBER_MAGIC;
+			header.nImageId = root->nImageId;
+			header.nIndex = m;
+			if(member_pwrite(m, &header, sizeof(header), 0) != sizeof(header)) {
+				return -1;
+			}
+		}
+		else if(header.magic_number != MEMBER_MAGIC || header.nImageId != root->nImageId ||
+				header.nIndex != m) {
+			fprintf(stderr, "%s is not image %d of %s\n", members[m].path, m + 1, image_path);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * counts every file and directory by walking the whole tree from the root,
+ * which is only needed when the counters in block 0 can't be trusted
+ * returns the count (the root included), -1 if a directory is damaged
+ */
+static long count_inodes(long root) {
+	cs1550_directory_node node;
+	long path_blocks[MAX_DIR_DEPTH + 1];
+	int slots[MAX_DIR_DEPTH];
+	long used = 1;
+	int todo_count = 1;
+	int todo_size = 64;
+	int i, count;
+
+	long *todo = (long *) malloc(todo_size * sizeof(long));
+	cs1550_file_directory *files = (cs1550_file_directory *) malloc(MAX_FILES_IN_LEAF * sizeof(cs1550_file_directory));
+	if(todo == NULL || files == NULL) {
+		free(todo);
+		free(files);
+		return -1;
+	}
+	todo[0] = root;
+
+	while(todo_count > 0 && used != -1) {
+		long dir = todo[--todo_count];
+		int depth = find_leaf(dir, 0, &node, path_blocks, slots);
+		long block = (depth == -1) ? -1 : path_blocks[depth];
+		while(block > 0) {
+			count = leaf_unpack(&node.leaf, files);
+			if(count == -1) {
+				block = -1;
+				break;
+			}
+			for(i = 0; i < count; i++) {
+				used++;
+				if(!S_ISDIR(files[i].mode)) {
+					continue;
+				}
+				if(todo_count == todo_size) {
+					todo_size *= 2;
+					long *more = (long *) realloc(todo, todo_size * sizeof(long));
+					if(more == NULL) {
+						block = -1;
+						break;
+					}
+					todo = more;
+				}
+				todo[todo_count++] = files[i].nStartBlock;
+			}
+			if(block == -1) {
+				break;
+			}
+			block = node.leaf.nNextLeaf;
+			if(block > 0 && get_dir_node(&node, block) != 1) {
+				block = -1;
+			}
+		}
+		if(block == -1) {
+			used = -1;
+		}
+	}
+	free(todo);
+	free(files);
+	return used;
+}
+
+/*
+ * sets used_inodes at mount. After a clean unmount block 0 has it, as long
+ * as its free block count agrees with the bitmap. Otherwise (a crash, or an
+ * image from before the counters) the tree is walked to count again.
+ * Block 0 is then marked in use, so a crash before the next clean unmount
+ * shows.
+ * returns 0 on success, -1 if the tree is damaged
+ */
+static int load_counters(cs1550_root_directory *root) {
+	if(root->nClean == 1 && root->nFreeBlocks == free_blocks && root->nUsedInodes > 0) {
+		used_inodes = root->nUsedInodes;
+	}
+	else {
+		used_inodes = count_inodes(root->nDirectoryTree);
+		if(used_inodes == -1) {
+			return -1;
+		}
+	}
+	root->nClean = 0;
+	put_root(root);
+	return 0;
+}
+
+/*
+ * writes the counters back to block 0 at unmount and marks it clean
+ */
+static void save_counters(void) {
+	cs1550_root_directory root;
+
+	if(get_root(&root) != 1 || root.magic_number != ROOT_MAGIC) {
+		return;
+	}
+	root.nFreeBlocks = free_blocks;
+	root.nUsedInodes = used_inodes;
+	root.nClean = 1;
+	put_root(&root);
+}
+
+/*
+ * checks block 0 at mount, setting up a blank (all zero) image
+ * The images data is striped across and the stripe unit are fixed when
+ * the image is formatted; later mounts have to list the same images in
+ * the same order.
+ * returns 0 on success, -1 if .disk holds something else
+ */
+static int prepare_image(void) {
+	cs1550_root_directory root;
+	cs1550_root_directory blank;
+
+	if(get_root(&root) != 1 || load_bitmap() == -1) {
+		return -1;
+	}
+	if(root.magic_number != ROOT_MAGIC) {
+		memset(&blank, 0, sizeof(cs1550_root_directory));
+		if(memcmp(&root, &blank, sizeof(cs1550_root_directory)) != 0) {
+			return -1;
+		}
+		root.magic_number = ROOT_MAGIC;
+		root.nBlockSize = BLOCK_SIZE;
+		root.nMembers = num_members;
+		root.nStripeBlocks = (stripe_blocks != 0) ? stripe_blocks : DEFAULT_STRIPE_BYTES / BLOCK_SIZE;
+		if(root.nStripeBlocks < 1) {
+			root.nStripeBlocks = 1;
+		}
+		root.nImageId = new_image_id();
+		stripe_blocks = root.nStripeBlocks;
+		if(check_members(&root, 1) == -1) {
+			return -1;
+		}
+		root.nDirectoryTree = create_directory_block(0);
+		if(root.nDirectoryTree == -1) {
+			return -1;
+		}
+	}
+	else {
+		if(root.nBlockSize != BLOCK_SIZE) {
+			fprintf(stderr, "%s was formatted with %ld byte blocks, not %d\n",
+					image_path, root.nBlockSize, BLOCK_SIZE);
+			return -1;
+		}
+		//images formatted before striping have no count: they are alone
+		if(root.nMembers == 0) {
+			root.nMembers = 1;
+			root.nStripeBlocks = DEFAULT_STRIPE_BYTES / BLOCK_SIZE;
+		}
+		if(root.nMembers != num_members) {
+			fprintf(stderr, "%s stripes data across %ld images, not %d\n",
+					image_path, root.nMembers, num_members);
+			return -1;
+		}
+		if(stripe_blocks != 0 && stripe_blocks != root.nStripeBlocks) {
+			fprintf(stderr, "%s has a %ld byte stripe unit\n",
+					image_path, root.nStripeBlocks * BLOCK_SIZE);
+			return -1;
+		}
+		stripe_blocks = root.nStripeBlocks;
+		if(check_members(&root, 0) == -1) {
+			return -1;
+		}
+	}
+	if(load_counters(&root) == -1) {
+		return -1;
+	}
+	root_tree = root.nDirectoryTree;
+	return 0;
+}
+
+/*
+ * which image the data block at start (a byte offset) is on
+ */
+static int data_member(long start) {
+	if(num_members <= 1) {
+		return 0;
+	}
+	return (start / BLOCK_SIZE / stripe_blocks) % num_members;
+}
+
+/*
+ * does one image's share of a striped read or write with pread/pwrite
+ * blocks that follow each other both in the image and in memory go in a
+ * single call, so a whole stripe unit is one request
+ * returns 0 on success, -EIO on failure
+ */
+static int run_batch(const struct cs1550_io_batch *batch) {
+	int i = 0;
+
+	while(i < batch->count) {
+		long start = batch->ios[i].start;
+		char *buf = batch->ios[i].buf;
+		size_t len = BLOCK_SIZE;
+		for(i++; i < batch->count; i++) {
+			if(batch->ios[i].start != start + (long) len || batch->ios[i].buf != buf + len) {
+				break;
+			}
+			len += BLOCK_SIZE;
+		}
+
+		size_t done = 0;
+		while(done < len) {
+			ssize_t n;
+			if(batch->write) {
+				n = member_pwrite(batch->member, buf + done, len - done, start + done);
+			}
+			else {
+				n = member_pread(batch->member, buf + done, len - done, start + done);
+			}
+			//a read that ends early ran off the end of a short image
+			if(n <= 0) {
+				return -EIO;
+			}
+			done += n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * marks a batch done, waking whoever is waiting once it was the last one
+ */
+static void finish_batch(struct cs1550_io_batch *batch, int res) {
+	struct cs1550_io_wait *wait = batch->wait;
+
+	pthread_mutex_lock(&wait->lock);
+	if(res != 0) {
+		wait->result = res;
+	}
+	wait->pending--;
+	if(wait->pending == 0) {
+		pthread_cond_signal(&wait->done);
+	}
+	pthread_mutex_unlock(&wait->lock);
+}
+
+/*
+ * worker thread for one image: runs the batches queued for it until
+ * unmount, finishing anything still queued first
+ */
+static void *member_thread(void *arg) {
+	struct cs1550_member *member = (struct cs1550_member *) arg;
+
+	pthread_mutex_lock(&member->lock);
+	while(1) {
+		while(member->queue == NULL && !member->stop) {
+			pthread_cond_wait(&member->work, &member->lock);
+		}
+		struct cs1550_io_batch *batch = member->queue;
+		if(batch == NULL) {
+			break;
+		}
+		member->queue = batch->next;
+		if(member->queue == NULL) {
+			member->tail = NULL;
+		}
+		pthread_mutex_unlock(&member->lock);
+		finish_batch(batch, run_batch(batch));
+		pthread_mutex_lock(&member->lock);
+	}
+	pthread_mutex_unlock(&member->lock);
+
+	return NULL;
+}
+
+/*
+ * reads or writes a list of data blocks, BLOCK_SIZE bytes each
+ * The blocks are split up by image. The calling thread does the first
+ * non-empty share itself (and any whose image has no worker running), and
+ * every other share is queued to its image's worker, so a read or write
+ * spanning several images runs on all of them at once.
+ * returns 0 on success, -EIO on failure
+ */
+static int data_io(const struct cs1550_block_io *ios, int count, int write) {
+	struct cs1550_io_batch batches[MAX_MEMBERS];
+	struct cs1550_io_wait wait;
+	int first[MAX_MEMBERS + 1];
+	int m, i, res;
+	int own = -1;
+
+	if(count <= 0) {
+		return 0;
+	}
+	if(num_members <= 1) {
+		struct cs1550_io_batch batch = { 0, write, (struct cs1550_block_io *) ios, count, NULL, NULL };
+		res = run_batch(&batch);
+		for(i = 0; i < count && write; i++) {
+			mark_dirty(ios[i].start, 0);
+		}
+		return res;
+	}
+
+	//sort the blocks by image, keeping their order within each
+	struct cs1550_block_io *sorted = (struct cs1550_block_io *) malloc(count * sizeof(struct cs1550_block_io));
+	if(sorted == NULL) {
+		return -EIO;
+	}
+	memset(first, 0, sizeof(first));
+	for(i = 0; i < count; i++) {
+		first[data_member(ios[i].start) + 1]++;
+	}
+	for(m = 0; m < num_members; m++) {
+		first[m + 1] += first[m];
+		batches[m].member = m;
+		batches[m].write = write;
+		batches[m].ios = sorted + first[m];
+		batches[m].count = 0;
+		batches[m].wait = &wait;
+		batches[m].next = NULL;
+	}
+	for(i = 0; i < count; i++) {
+		m = data_member(ios[i].start);
+		batches[m].ios[batches[m].count++] = ios[i];
+	}
+
+	pthread_mutex_init(&wait.lock, NULL);
+	pthread_cond_init(&wait.done, NULL);
+	wait.pending = 0;
+	wait.result = 0;
+	for(m = 0; m < num_members; m++) {
+		if(batches[m].count == 0) {
+			continue;
+		}
+		if(own == -1 || !members[m].running) {
+			//the first share is ours, and so is any without a worker
+			if(own == -1) {
+				own = m;
+			}
+			else if(run_batch(&batches[m]) != 0) {
+				wait.result = -EIO;
+			}
+			continue;
+		}
+		pthread_mutex_lock(&wait.lock);
+		wait.pending++;
+		pthread_mutex_unlock(&wait.lock);
+
+		pthread_mutex_lock(&members[m].lock);
+		if(members[m].tail != NULL) {
+			members[m].tail->next = &batches[m];
+		}
+		else {
+			members[m].queue = &batches[m];
+		}
+		members[m].tail = &batches[m];
+		pthread_cond_signal(&members[m].work);
+		pthread_mutex_unlock(&members[m].lock);
+	}
+
+	res = run_batch(&batches[own]);
+
+	pthread_mutex_lock(&wait.lock);
+	while(wait.pending > 0) {
+		pthread_cond_wait(&wait.done, &wait.lock);
+	}
+	if(res == 0) {
+		res = wait.result;
+	}
+	pthread_mutex_unlock(&wait.lock);
+	pthread_mutex_destroy(&wait.lock);
+	pthread_cond_destroy(&wait.done);
+	free(sorted);
+
+	for(i = 0; i < count && write; i++) {
+		mark_dirty(ios[i].start, 0);
+	}
+	return res;
+}
+
+/*
+ * finds data block on disk
+ * returns 1 on success, 0 on failure
+ */
+static int get_disk_block(cs1550_disk_block* cur_disk_block, long start_block) {
+	struct cs1550_block_io io = { start_block, cur_disk_block->data };
+	return data_io(&io, 1, 0) == 0;
+}
+
+/*
+ * writes a data block back to disk
+ * returns 1 on success, 0 on failure
+ */
+static int put_disk_block(const cs1550_disk_block *cur_disk_block, long start_block) {
+	struct cs1550_block_io io = { start_block, (char *) cur_disk_block->data };
+	return data_io(&io, 1, 1) == 0;
+}
+
+/*
+ * the lock a file's data is read, written and moved under. Readers share
+ * it; writes, truncates and the defragmenter take it alone since they
+ * rewrite the inode.
+ */
+static pthread_rwlock_t *file_lock(long inode_start) {
+	return &file_locks[(inode_start / BLOCK_SIZE) % FILE_LOCKS];
+}
+
+/*
+ * the change counter of the file at inode_start, see file_changes
+ * caller holds the file's lock
+ */
+static unsigned long *file_change(long inode_start) {
+	return &file_changes[(inode_start / BLOCK_SIZE) % FILE_LOCKS];
+}
+
+/*
+ * reads in the inode stored at inode_start
+ * returns 1 on success, 0 on failure
+ */
+static int get_inode(cs1550_inode *inode, long inode_start) {
+	FILE *f = open_image("rb");
+	fseek(f, inode_start, SEEK_SET);
+	int result = fread(inode, sizeof(cs1550_inode), 1, f);
+	fclose(f);
+	return result;
+}
+
+/*
+ * writes an inode back to disk
+ * returns 1 on success, 0 on failure
+ */
+static int put_inode(const cs1550_inode *inode, long inode_start) {
+	FILE *f = open_image("rb+");
+	fseek(f, inode_start, SEEK_SET);
+	int result = fwrite(inode, sizeof(cs1550_inode), 1, f);
+	fclose(f);
+	mark_dirty(inode_start, 1);
+	return result;
+}
+
+/*
+ * zeroes a data block image so holes and fresh blocks read back as zeros
+ */
+static void clear_disk_block(cs1550_disk_block *cur_disk_block) {
+	memset(cur_disk_block, 0, sizeof(cs1550_disk_block));
+}
+
+/*
+ * writes the in-memory orphan list back to its block
+ * caller holds orphan_lock
+ */
+static void put_orphans(void) {
+	FILE *f = open_image("rb+");
+	fseek(f, orphan_block, SEEK_SET);
+	fwrite(&orphans, sizeof(cs1550_orphan_list), 1, f);
+	fclose(f);
+	mark_dirty(orphan_block, 1);
+}
+
+/*
+ * reads in the orphan list at mount, creating its block the first time
+ * an image is mounted
+ */
+static void load_orphans(void) {
+	cs1550_root_directory root;
+
+	pthread_mutex_lock(&orphan_lock);
+	get_root(&root);
+	if(root.nOrphanBlock != 0) {
+		orphan_block = root.nOrphanBlock;
+		FILE *f = open_image("rb");
+		fseek(f, orphan_block, SEEK_SET);
+		fread(&orphans, sizeof(cs1550_orphan_list), 1, f);
+		fclose(f);
+	}
+	if(root.nOrphanBlock == 0 || orphans.magic_number != ORPHAN_MAGIC) {
+		int block = allocate_block(0);
+		if(block != -1) {
+			orphan_block = (long) block * BLOCK_SIZE;
+			memset(&orphans, 0, sizeof(cs1550_orphan_list));
+			orphans.magic_number = ORPHAN_MAGIC;
+			put_orphans();
+
+			root.nOrphanBlock = orphan_block;
+			put_root(&root);
+		}
+		else {
+			orphan_block = 0;
+		}
+	}
+	pthread_mutex_unlock(&orphan_lock);
+}
+
+/*
+ * collects the data blocks and the inode block of every given inode into
+ * *blocks, which it allocates and the caller frees. An orphan can also be
+ * an empty directory the low-level API removed (see cs1550_ll_rmdir), in
+ * which case its index and leaf blocks are collected.
+ * returns how many blocks there are, -1 if memory ran out
+ */
+static int collect_inodes(const long *inodes, int count, int **blocks) {
+	cs1550_inode inode;
+	cs1550_directory_node node;
+	int num_blocks = 0;
+	int size = 0;
+	int i, res;
+	unsigned int j;
+
+	*blocks = NULL;
+	for(i = 0; i < count; i++) {
+		//skip anything that doesn't look like an inode rather than freeing
+		//blocks we don't own. The lock waits out the defragmenter, if it is
+		//moving this file, so the blocks read are the ones in use.
+		pthread_rwlock_wrlock(file_lock(inodes[i]));
+		(*file_change(inodes[i]))++;
+		if(get_inode(&inode, inodes[i]) != 1 || inode.magic_number != 0xFFFFFFFF ||
+				inode.children > NUM_POINTERS_IN_INODE) {
+			pthread_rwlock_unlock(file_lock(inodes[i]));
+
+			int before = num_blocks;
+			pthread_rwlock_rdlock(&dir_lock);
+			res = 0;
+			if(get_dir_node(&node, inodes[i]) == 1 && (node.leaf.magic_number == DIR_LEAF_MAGIC ||
+					node.index.magic_number == DIR_INDEX_MAGIC)) {
+				res = dir_collect_blocks(inodes[i], 0, blocks, &num_blocks, &size);
+			}
+			pthread_rwlock_unlock(&dir_lock);
+			if(res == -ENOMEM) {
+				free(*blocks);
+				*blocks = NULL;
+				return -1;
+			}
+			if(res != 0) {
+				num_blocks = before;
+			}
+			continue;
+		}
+		if(num_blocks + (int) inode.children + 1 > size) {
+			size = size * 2 + inode.children + 1;
+			int *more = (int *) realloc(*blocks, size * sizeof(int));
+			if(more == NULL) {
+				pthread_rwlock_unlock(file_lock(inodes[i]));
+				free(*blocks);
+				*blocks = NULL;
+				return -1;
+			}
+			*blocks = more;
+		}
+		for(j = 0; j < inode.children; j++) {
+			if(inode.pointers[j] != 0) {
+				(*blocks)[num_blocks++] = inode.pointers[j] / BLOCK_SIZE;
+			}
+		}
+		pthread_rwlock_unlock(file_lock(inodes[i]));
+		(*blocks)[num_blocks++] = inodes[i] / BLOCK_SIZE;
+	}
+	return num_blocks;
+}
+
+/*
+ * frees the data blocks and the inode block of every given inode
+ * with one bitmap update for the whole batch, or one per inode if memory
+ * is too short for the batch
+ * returns 0 on success, -ENOMEM if some inode couldn't be freed
+ */
+static int free_inodes(const long *inodes, int count) {
+	int *blocks;
+	int res = 0;
+	int i;
+
+	int num_blocks = collect_inodes(inodes, count, &blocks);
+	if(num_blocks == -1) {
+		if(count == 1) {
+			return -ENOMEM;
+		}
+		for(i = 0; i < count; i++) {
+			if(free_inodes(&inodes[i], 1) != 0) {
+				res = -ENOMEM;
+			}
+		}
+		return res;
+	}
+	if(num_blocks > 0) {
+		update_bitmap_blocks("free", blocks, num_blocks);
+	}
+	free(blocks);
+	return 0;
+}
+
+/*
+ * frees every orphan on the list, then drops them from it
+ * Every group the batch touches stays locked until the shortened list is
+ * written, so none of its blocks can be handed out again while the list
+ * still names their inodes. A crash before the list is written leaves the
+ * batch on it with its inodes intact, and freeing it again at the next
+ * mount, before anything is allocated, only clears bits already clear.
+ * returns how many orphans were freed
+ */
+static int reclaim_orphans(void) {
+	long batch[MAX_ORPHANS];
+	int count, num_blocks, valid, i;
+
+	//one batch at a time, so no two take the same orphans
+	pthread_mutex_lock(&reclaim_lock);
+	pthread_mutex_lock(&orphan_lock);
+	count = orphans.nOrphans;
+	memcpy(batch, orphans.inodes, count * sizeof(long));
+	pthread_mutex_unlock(&orphan_lock);
+	if(count == 0) {
+		pthread_mutex_unlock(&reclaim_lock);
+		return 0;
+	}
+
+	int *blocks;
+	num_blocks = collect_inodes(batch, count, &blocks);
+	if(num_blocks == -1) {
+		//the batch stays queued for the next try
+		pthread_mutex_unlock(&reclaim_lock);
+		return 0;
+	}
+	qsort(blocks, num_blocks, sizeof(int), compare_blocks);
+	//leave out anything the bitmap doesn't describe
+	valid = 0;
+	for(i = 0; i < num_blocks; i++) {
+		if(blocks[i] >= 1 && blocks[i] <= BITMAP_SIZE * 8) {
+			blocks[valid++] = blocks[i];
+		}
+	}
+
+	pthread_mutex_lock(&orphan_lock);
+	for(i = 0; i < valid; i++) {
+		if(i == 0 || (blocks[i] - 1) / GROUP_BLOCKS != (blocks[i - 1] - 1) / GROUP_BLOCKS) {
+			pthread_mutex_lock(&groups[(blocks[i] - 1) / GROUP_BLOCKS].lock);
+		}
+		mark_block(blocks[i], 0);
+	}
+	for(i = 0; i < valid; i++) {
+		if(i == 0 || (blocks[i] - 1) / GROUP_BLOCKS != (blocks[i - 1] - 1) / GROUP_BLOCKS) {
+			put_group((blocks[i] - 1) / GROUP_BLOCKS);
+		}
+	}
+
+	//anything unlinked since the batch was copied stays queued
+	orphans.nOrphans = orphans.nOrphans - count;
+	memmove(orphans.inodes, &orphans.inodes[count], orphans.nOrphans * sizeof(long));
+	put_orphans();
+
+	for(i = 0; i < valid; i++) {
+		if(i == 0 || (blocks[i] - 1) / GROUP_BLOCKS != (blocks[i - 1] - 1) / GROUP_BLOCKS) {
+			pthread_mutex_unlock(&groups[(blocks[i] - 1) / GROUP_BLOCKS].lock);
+		}
+	}
+	pthread_mutex_unlock(&orphan_lock);
+	pthread_mutex_unlock(&reclaim_lock);
+	free(blocks);
+	return count;
+}
+
+/*
+ * background thread that gives unlinked files' blocks back to the bitmap
+ * waits briefly after the first orphan shows up so that mass deletes get
+ * freed in a few large batches instead of one bitmap update per file
+ */
+static void *reclaim_thread(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&orphan_lock);
+	while(!reclaimer_stop) {
+		while(orphans.nOrphans == 0 && !reclaimer_stop) {
+			pthread_cond_wait(&orphan_added, &orphan_lock);
+		}
+
+		struct timeval now;
+		struct timespec deadline;
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec;
+		deadline.tv_nsec = now.tv_usec * 1000 + RECLAIM_DELAY_MS * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while(orphans.nOrphans < (long) MAX_ORPHANS / 2 && !reclaimer_stop) {
+			if(pthread_cond_timedwait(&orphan_added, &orphan_lock, &deadline) != 0) {
+				break;
+			}
+		}
+
+		pthread_mutex_unlock(&orphan_lock);
+		reclaim_orphans();
+		pthread_mutex_lock(&orphan_lock);
+	}
+	pthread_mutex_unlock(&orphan_lock);
+
+	return NULL;
+}
+
+/*
+ * hands an unlinked file's inode to the reclaimer
+ * if the list is full the caller frees a batch itself, and without an orphan
+ * block (image never mounted through init) the inode is freed right away
+ */
+static void add_orphan(long inode_start) {
+	pthread_mutex_lock(&orphan_lock);
+	if(orphan_block == 0) {
+		pthread_mutex_unlock(&orphan_lock);
+		if(free_inodes(&inode_start, 1) != 0) {
+			fprintf(stderr, "no memory to free inode at %ld\n", inode_start);
+		}
+		return;
+	}
+	while(orphans.nOrphans >= (long) MAX_ORPHANS) {
+		pthread_mutex_unlock(&orphan_lock);
+		reclaim_orphans();
+		pthread_mutex_lock(&orphan_lock);
+	}
+	orphans.inodes[orphans.nOrphans] = inode_start;
+	orphans.nOrphans = orphans.nOrphans + 1;
+	put_orphans();
+	if(!reclaimer_running) {
+		pthread_mutex_unlock(&orphan_lock);
+		reclaim_orphans();
+		return;
+	}
+	pthread_cond_signal(&orphan_added);
+	pthread_mutex_unlock(&orphan_lock);
+}
+
+/*
+ * maps len bytes of anonymous memory for an image, in huge pages if any
+ * are reserved and otherwise asking for transparent ones
+ * returns the memory, NULL on failure
+ */
+static char *map_ram(size_t len) {
+	void *ram = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if(ram == MAP_FAILED) {
+		ram = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(ram == MAP_FAILED) {
+			return NULL;
+		}
+		madvise(ram, len, MADV_HUGEPAGE);
+	}
+	return (char *) ram;
+}
+
+/*
+ * lets go of the images in memory without writing anything back
+ */
+static void drop_ram(void) {
+	int m;
+
+	for(m = 0; m < num_members; m++) {
+		if(members[m].ram != NULL) {
+			munmap(members[m].ram, members[m].ram_length);
+			members[m].ram = NULL;
+		}
+		free(members[m].dirty);
+		free(members[m].pending);
+		free(members[m].saved);
+		members[m].dirty = NULL;
+		members[m].pending = NULL;
+		members[m].saved = NULL;
+	}
+	free(checkpoint_buf);
+	checkpoint_buf = NULL;
+}
+
+/*
+ * reads every image into memory for -o ram
+ * returns 0 on success, -1 on failure
+ */
+static int load_ram(void) {
+	int m;
+
+	checkpoint_buf = (char *) malloc(CHECKPOINT_RUN * BLOCK_SIZE);
+	if(checkpoint_buf == NULL) {
+		return -1;
+	}
+	for(m = 0; m < num_members; m++) {
+		struct cs1550_member *member = &members[m];
+		off_t done = 0;
+
+		member->size = lseek(member->fd, 0, SEEK_END);
+		long blocks = (member->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		member->ram_length = ((size_t) blocks * BLOCK_SIZE + HUGE_PAGE_SIZE - 1) /
+				HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		if(member->size <= 0) {
+			drop_ram();
+			return -1;
+		}
+		member->ram = map_ram(member->ram_length);
+		member->dirty = (unsigned char *) calloc((blocks + 7) / 8, 1);
+		member->pending = (unsigned char *) calloc((blocks + 7) / 8, 1);
+		member->saved = (char **) calloc(blocks, sizeof(char *));
+		if(member->ram == NULL || member->dirty == NULL || member->pending == NULL ||
+				member->saved == NULL) {
+			fprintf(stderr, "no memory to hold %s\n", member->path);
+			drop_ram();
+			return -1;
+		}
+		while(done < member->size) {
+			ssize_t n = pread(member->fd, member->ram + done, member->size - done, done);
+			if(n <= 0) {
+				fprintf(stderr, "%s: %s\n", member->path, (n == 0) ? "short read" : strerror(errno));
+				drop_ram();
+				return -1;
+			}
+			done += n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * copies block of an image in memory into buf for the running checkpoint:
+ * what it held when the checkpoint began, copied aside if it has been
+ * written since
+ * returns 1 if it was copied, 0 if the checkpoint doesn't need it (anymore)
+ */
+static int checkpoint_block(struct cs1550_member *member, long block, char *buf) {
+	unsigned char bit = 128 >> (block % 8);
+	int taken = 0;
+
+	pthread_mutex_lock(&ram_locks[block % RAM_LOCKS]);
+	if(__atomic_load_n(&member->pending[block / 8], __ATOMIC_RELAXED) & bit) {
+		if(member->saved[block] != NULL) {
+			memcpy(buf, member->saved[block], BLOCK_SIZE);
+			free(member->saved[block]);
+			member->saved[block] = NULL;
+		}
+		else {
+			memcpy(buf, member->ram + block * BLOCK_SIZE, BLOCK_SIZE);
+		}
+		__sync_fetch_and_and(&member->pending[block / 8], (unsigned char) ~bit);
+		taken = 1;
+	}
+	pthread_mutex_unlock(&ram_locks[block % RAM_LOCKS]);
+
+	return taken;
+}
+
+/*
+ * writes every block changed since the last checkpoint back to its image,
+ * as it was at one instant. Writes only wait while the dirty sets are taken;
+ * the ones after that land in memory as usual, copying a block aside first
+ * if this checkpoint still has to write it.
+ * Blocks that fail to be written stay dirty for the next checkpoint.
+ * returns 0 on success, negative errno on failure
+ */
+static int checkpoint(void) {
+	int res = 0;
+	int m;
+
+	pthread_mutex_lock(&checkpoint_lock);
+	pthread_rwlock_wrlock(&ram_lock);
+	for(m = 0; m < num_members; m++) {
+		size_t bytes = ((members[m].size + BLOCK_SIZE - 1) / BLOCK_SIZE + 7) / 8;
+		memcpy(members[m].pending, members[m].dirty, bytes);
+		memset(members[m].dirty, 0, bytes);
+	}
+	pthread_rwlock_unlock(&ram_lock);
+
+	for(m = 0; m < num_members; m++) {
+		struct cs1550_member *member = &members[m];
+		long blocks = (member->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		long block = 0;
+		int wrote = 0;
+
+		while(block < blocks) {
+			//a run of blocks that follow each other goes in one write
+			long first = block;
+			int count = 0;
+			while(block < blocks && count < CHECKPOINT_RUN &&
+					checkpoint_block(member, block, checkpoint_buf + (size_t) count * BLOCK_SIZE)) {
+				block++;
+				count++;
+			}
+			if(count == 0) {
+				block++;
+				continue;
+			}
+
+			off_t start = (off_t) first * BLOCK_SIZE;
+			size_t bytes = (size_t) count * BLOCK_SIZE;
+			if(start + (off_t) bytes > member->size) {
+				bytes = member->size - start;
+			}
+			if(pwrite(member->fd, checkpoint_buf, bytes, start) != (ssize_t) bytes) {
+				res = -EIO;
+				for(block = first; block < first + count; block++) {
+					__sync_fetch_and_or(&member->dirty[block / 8], (unsigned char) (128 >> (block % 8)));
+				}
+			}
+			wrote = 1;
+		}
+		if(wrote && res == 0 && durability != DURABILITY_NONE && fdatasync(member->fd) != 0) {
+			res = -errno;
+		}
+	}
+	pthread_mutex_unlock(&checkpoint_lock);
+
+	return res;
+}
+
+/*
+ * background thread that checkpoints every -o checkpoint= seconds until
+ * unmount
+ */
+static void *checkpoint_thread(void *arg) {
+	(void) arg;
+	struct timeval now;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&checkpointer_lock);
+	while(!checkpointer_stop) {
+		if(checkpoint_secs == 0) {
+			pthread_cond_wait(&checkpoint_wake, &checkpointer_lock);
+			continue;
+		}
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + checkpoint_secs;
+		deadline.tv_nsec = now.tv_usec * 1000;
+		if(pthread_cond_timedwait(&checkpoint_wake, &checkpointer_lock, &deadline) == ETIMEDOUT &&
+				!checkpointer_stop) {
+			pthread_mutex_unlock(&checkpointer_lock);
+			checkpoint();
+			pthread_mutex_lock(&checkpointer_lock);
+		}
+	}
+	pthread_mutex_unlock(&checkpointer_lock);
+
+	return NULL;
+}
+
+/*
+ * starts the checkpointer at mount, for images held in memory
+ */
+static void start_checkpointer(void) {
+	if(members[0].ram == NULL) {
+		return;
+	}
+	checkpointer_stop = 0;
+	if(pthread_create(&checkpointer, NULL, checkpoint_thread, NULL) == 0) {
+		checkpointer_running = 1;
+	}
+}
+
+/*
+ * stops the checkpointer, writes the images in memory back one last time
+ * and lets go of them
+ */
+static void unload_ram(void) {
+	if(checkpointer_running) {
+		pthread_mutex_lock(&checkpointer_lock);
+		checkpointer_stop = 1;
+		pthread_cond_signal(&checkpoint_wake);
+		pthread_mutex_unlock(&checkpointer_lock);
+		pthread_join(checkpointer, NULL);
+		checkpointer_running = 0;
+	}
+	if(checkpoint() != 0) {
+		fprintf(stderr, "%s: not everything was written back\n", image_path);
+	}
+	drop_ram();
+}
+
+/*
+ * opens every image, just .disk without -o images=
+ * returns 0 on success, -1 if one can't be opened
+ */
+static int open_members(void) {
+	int m;
+
+	if(num_members == 0) {
+		members[0].path = (char *) image_path;
+		num_members = 1;
+	}
+	for(m = 0; m < num_members; m++) {
+		members[m].fd = open(members[m].path, O_RDWR);
+		if(members[m].fd == -1) {
+			fprintf(stderr, "%s: %s\n", members[m].path, strerror(errno));
+			while(m-- > 0) {
+				close(members[m].fd);
+				members[m].fd = -1;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * starts a worker for every image when data is striped across several
+ * (unless they are held in memory, which is copied faster than a worker
+ * could be handed the job)
+ */
+static void start_members(void) {
+	int m;
+
+	if(num_members < 2 || members[0].ram != NULL) {
+		return;
+	}
+	for(m = 0; m < num_members; m++) {
+		pthread_mutex_init(&members[m].lock, NULL);
+		pthread_cond_init(&members[m].work, NULL);
+		members[m].queue = NULL;
+		members[m].tail = NULL;
+		members[m].stop = 0;
+		if(pthread_create(&members[m].worker, NULL, member_thread, &members[m]) == 0) {
+			members[m].running = 1;
+		}
+	}
+}
+
+/*
+ * stops the workers once their queues are empty, writes the images held in
+ * memory back and closes every image
+ */
+static void close_members(void) {
+	int m;
+
+	if(members[0].ram != NULL) {
+		unload_ram();
+	}
+	for(m = 0; m < num_members; m++) {
+		if(members[m].running) {
+			pthread_mutex_lock(&members[m].lock);
+			members[m].stop = 1;
+			pthread_cond_signal(&members[m].work);
+			pthread_mutex_unlock(&members[m].lock);
+			pthread_join(members[m].worker, NULL);
+			members[m].running = 0;
+			pthread_mutex_destroy(&members[m].lock);
+			pthread_cond_destroy(&members[m].work);
+		}
+		if(members[m].fd != -1) {
+			close(members[m].fd);
+			members[m].fd = -1;
+		}
+	}
+}
+
+/*
+ * calls sync_file_range with flags on every run of blocks set in meta, and
+ * on the bitmap if it is dirty
+ * returns 0 on success, negative errno on failure
+ */
+static int sync_ranges(int fd, const unsigned char *meta, int bitmap, unsigned int flags) {
+	long limit = BITMAP_SIZE * 8 + 1;
+	long block = 0;
+
+	while(block < limit) {
+		if(!(meta[block / 8] & (128 >> (block % 8)))) {
+			block++;
+			continue;
+		}
+		long first = block;
+		while(block < limit && (meta[block / 8] & (128 >> (block % 8)))) {
+			block++;
+		}
+		if(sync_file_range(fd, first * BLOCK_SIZE, (block - first) * BLOCK_SIZE, flags) != 0) {
+			return -errno;
+		}
+	}
+	if(bitmap && sync_file_range(fd, bitmap_offset, BITMAP_SIZE, flags) != 0) {
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * writes back the data blocks at starts, in order, with sync_file_range on
+ * whichever image each is striped onto, one call per run of neighbours
+ * notes every image written to in used
+ * returns 0 on success, negative errno on failure
+ */
+static int sync_data(const long *starts, int count, unsigned int flags, int *used) {
+	int i = 0;
+
+	while(i < count) {
+		long first = starts[i];
+		long len = BLOCK_SIZE;
+		int m = data_member(first);
+		for(i++; i < count && starts[i] == first + len && data_member(starts[i]) == m; i++) {
+			len += BLOCK_SIZE;
+		}
+		if(sync_file_range(members[m].fd, first, len, flags) != 0) {
+			return -errno;
+		}
+		used[m] = 1;
+	}
+	return 0;
+}
+
+/*
+ * makes whichever of the data blocks at starts were written since they were
+ * last synced durable, along with every dirty metadata block if meta, as
+ * far as the durability mode asks: nothing at all, or the blocks written
+ * back with sync_file_range (all started before any is waited on), followed
+ * by fdatasync of the images written to, which flushes the devices' write
+ * caches. Data blocks not in starts are left alone.
+ * returns 0 on success, negative errno on failure
+ */
+static int sync_image(const long *starts, int count, int meta) {
+	unsigned char meta_set[BITMAP_SIZE + 1];
+	int used[MAX_MEMBERS];
+	int bitmap = 0;
+	int any = 0;
+	int res = 0;
+	int taken = 0;
+	int i, m;
+
+	if(durability == DURABILITY_NONE) {
+		return 0;
+	}
+	if(members[0].ram != NULL) {
+		return checkpoint();
+	}
+	long *dirty = (long *) malloc((count + 1) * sizeof(long));
+	if(dirty == NULL) {
+		return -ENOMEM;
+	}
+
+	//take the dirty blocks; anything written from here on is the next sync's
+	memset(meta_set, 0, sizeof(meta_set));
+	pthread_mutex_lock(&dirty_lock);
+	for(i = 0; i < count; i++) {
+		long block = starts[i] / BLOCK_SIZE;
+		unsigned char bit = 128 >> (block % 8);
+		if(block <= BITMAP_SIZE * 8 && (dirty_data[block / 8] & bit)) {
+			dirty_data[block / 8] &= ~bit;
+			dirty[taken++] = starts[i];
+		}
+	}
+	if(meta) {
+		memcpy(meta_set, dirty_meta, sizeof(meta_set));
+		memset(dirty_meta, 0, sizeof(dirty_meta));
+		bitmap = dirty_bitmap;
+		dirty_bitmap = 0;
+	}
+	pthread_mutex_unlock(&dirty_lock);
+
+	for(i = 0; i < (int) sizeof(meta_set); i++) {
+		any |= meta_set[i];
+	}
+	memset(used, 0, sizeof(used));
+	if(any || bitmap) {
+		used[0] = 1;
+	}
+
+	if(members[0].fd == -1) {
+		res = -EIO;
+	}
+	if(res == 0) {
+		res = sync_data(dirty, taken, SYNC_FILE_RANGE_WRITE, used);
+	}
+	if(res == 0) {
+		res = sync_ranges(members[0].fd, meta_set, bitmap, SYNC_FILE_RANGE_WRITE);
+	}
+	if(res == 0) {
+		res = sync_data(dirty, taken, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER, used);
+	}
+	if(res == 0) {
+		res = sync_ranges(members[0].fd, meta_set, bitmap, SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	}
+	//sync_file_range leaves the blocks in the devices' write caches; only
+	//fdatasync flushes those, and by now it has nothing of ours left to write
+	for(m = 0; m < num_members && res == 0; m++) {
+		if(used[m] && fdatasync(members[m].fd) != 0) {
+			res = -errno;
+		}
+	}
+
+	//whatever didn't make it stays dirty for the next try
+	if(res != 0) {
+		pthread_mutex_lock(&dirty_lock);
+		for(i = 0; i < (int) sizeof(meta_set); i++) {
+			dirty_meta[i] |= meta_set[i];
+		}
+		for(i = 0; i < taken; i++) {
+			long block = dirty[i] / BLOCK_SIZE;
+			dirty_data[block / 8] |= 128 >> (block % 8);
+		}
+		dirty_bitmap |= bitmap;
+		pthread_mutex_unlock(&dirty_lock);
+	}
+	free(dirty);
+	return res;
+}
+
+/*
+ * makes the file at inode_start durable: its data (for full durability)
+ * and the metadata, see sync_image
+ * datasync leaves out the metadata unless the file's inode block is dirty,
+ * which every change to its size or block pointers makes it
+ * returns 0 on success, negative errno on failure
+ */
+static int sync_file(long inode_start, int datasync) {
+	cs1550_inode inode;
+	unsigned int i;
+	int count = 0;
+	int meta = 1;
+
+	if(datasync) {
+		long block = inode_start / BLOCK_SIZE;
+		pthread_mutex_lock(&dirty_lock);
+		meta = (dirty_meta[block / 8] & (128 >> (block % 8))) != 0;
+		pthread_mutex_unlock(&dirty_lock);
+	}
+	if(durability != DURABILITY_FULL || members[0].ram != NULL) {
+		return sync_image(NULL, 0, meta);
+	}
+	long *starts = (long *) malloc(NUM_POINTERS_IN_INODE * sizeof(long));
+	if(starts == NULL) {
+		return -ENOMEM;
+	}
+	pthread_rwlock_t *lock = file_lock(inode_start);
+	pthread_rwlock_rdlock(lock);
+	if(get_inode(&inode, inode_start) == 1 && inode.children <= NUM_POINTERS_IN_INODE) {
+		for(i = 0; i < inode.children; i++) {
+			if(inode.pointers[i] != 0) {
+				starts[count++] = inode.pointers[i];
+			}
+		}
+	}
+	pthread_rwlock_unlock(lock);
+
+	int res = sync_image(starts, count, meta);
+	free(starts);
+	return res;
+}
+
+#ifndef CS1550_LOWLEVEL
+/*
+ * nanoseconds on the monotonic clock
+ */
+static unsigned long long trace_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * gives the calling thread a ring of its own the first time it records
+ * something, pushing it onto the list the flusher walks without a lock
+ * returns the ring, NULL if there is no memory for one
+ */
+static struct cs1550_trace_ring *trace_ring(void) {
+	static __thread struct cs1550_trace_ring *ring = NULL;
+	static __thread unsigned int ring_generation = 0;
+
+	if(ring != NULL && ring_generation == trace_generation) {
+		return ring;
+	}
+	ring = (struct cs1550_trace_ring *) calloc(1, sizeof(struct cs1550_trace_ring));
+	if(ring == NULL) {
+		return NULL;
+	}
+	ring->thread = __sync_add_and_fetch(&trace_threads, 1);
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE);
+	while(!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 0,
+			__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+	}
+	ring_generation = trace_generation;
+	return ring;
+}
+
+/*
+ * copies len bytes into a ring at byte position pos (a running count that
+ * wraps around the ring)
+ */
+static void ring_copy(struct cs1550_trace_ring *ring, unsigned long pos, const void *src, size_t len) {
+	size_t at = pos % TRACE_RING_BYTES;
+	size_t first = TRACE_RING_BYTES - at;
+
+	if(first > len) {
+		first = len;
+	}
+	memcpy(&ring->data[at], src, first);
+	memcpy(ring->data, (const char *) src + first, len - first);
+}
+
+/*
+ * records one call in the calling thread's ring. The thread never waits:
+ * when the flusher has fallen a whole ring behind the record is dropped
+ * and counted instead.
+ * start is trace_now() from just before the call
+ */
+static void trace_record(int op, const char *path, long long offset, unsigned long long size,
+			 unsigned int mode, long long result, unsigned long long start) {
+	unsigned long long end = trace_now();
+	struct cs1550_trace_ring *ring = trace_ring();
+	cs1550_trace_record record;
+
+	if(ring == NULL) {
+		return;
+	}
+	size_t path_len = (path != NULL) ? strlen(path) : 0;
+	if(path_len > TRACE_MAX_PATH) {
+		path_len = TRACE_MAX_PATH;
+	}
+	memset(&record, 0, sizeof(cs1550_trace_record));
+	record.op = op;
+	record.pathLen = path_len;
+	record.thread = ring->thread;
+	record.mode = mode;
+	record.result = result;
+	record.offset = offset;
+	record.size = size;
+	record.start = start - trace_epoch;
+	record.duration = end - start;
+
+	//only this thread moves head, only the flusher moves tail
+	unsigned long head = ring->head;
+	unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if(head - tail + sizeof(cs1550_trace_record) + path_len > TRACE_RING_BYTES) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ring_copy(ring, head, &record, sizeof(cs1550_trace_record));
+	ring_copy(ring, head + sizeof(cs1550_trace_record), path, path_len);
+	__atomic_store_n(&ring->head, head + sizeof(cs1550_trace_record) + path_len, __ATOMIC_RELEASE);
+}
+
+/*
+ * writes out everything the rings hold, and a TRACE_DROPPED record for any
+ * ring that had to throw records away since the last time
+ * caller is the flusher (or the only thread left)
+ */
+static void trace_drain(void) {
+	struct cs1550_trace_ring *ring;
+
+	for(ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		unsigned long tail = ring->tail;
+		while(tail != head) {
+			size_t at = tail % TRACE_RING_BYTES;
+			size_t len = TRACE_RING_BYTES - at;
+			if(len > head - tail) {
+				len = head - tail;
+			}
+			fwrite(&ring->data[at], len, 1, trace_file);
+			tail += len;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if(dropped != ring->reported) {
+			cs1550_trace_record record;
+			memset(&record, 0, sizeof(cs1550_trace_record));
+			record.op = TRACE_DROPPED;
+			record.thread = ring->thread;
+			record.size = dropped - ring->reported;
+			record.start = trace_now() - trace_epoch;
+			fwrite(&record, sizeof(cs1550_trace_record), 1, trace_file);
+			ring->reported = dropped;
+		}
+	}
+	fflush(trace_file);
+}
+
+/*
+ * background thread that empties the rings into the trace file every
+ * TRACE_FLUSH_MS until tracing stops
+ */
+static void *trace_thread(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&trace_lock);
+	while(!trace_stop) {
+		struct timeval now;
+		struct timespec deadline;
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec;
+		deadline.tv_nsec = now.tv_usec * 1000 + TRACE_FLUSH_MS * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&trace_wake, &trace_lock, &deadline);
+		pthread_mutex_unlock(&trace_lock);
+		trace_drain();
+		pthread_mutex_lock(&trace_lock);
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	return NULL;
+}
+
+/*
+ * opens the trace file for -o trace= and writes its header. It is opened
+ * here rather than at mount so a relative path still means what it did on
+ * the command line.
+ * returns 0 on success, -1 on failure
+ */
+static int trace_open(const char *path) {
+	cs1550_trace_header header;
+
+	trace_file = fopen(path, "wb");
+	if(trace_file == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(&header, 0, sizeof(cs1550_trace_header));
+	header.magic_number = TRACE_MAGIC;
+	header.nVersion = TRACE_VERSION;
+	header.nBlockSize = BLOCK_SIZE;
+	fwrite(&header, sizeof(cs1550_trace_header), 1, trace_file);
+	fflush(trace_file);
+	return 0;
+}
+
+/*
+ * starts recording at mount: every ring from before is thrown away and the
+ * clock restarts
+ */
+static void trace_start(void) {
+	struct cs1550_trace_ring *ring = __atomic_exchange_n(&trace_rings, NULL, __ATOMIC_ACQ_REL);
+
+	while(ring != NULL) {
+		struct cs1550_trace_ring *next = ring->next;
+		free(ring);
+		ring = next;
+	}
+	__sync_add_and_fetch(&trace_generation, 1);
+	trace_epoch = trace_now();
+	trace_stop = 0;
+	if(pthread_create(&tracer, NULL, trace_thread, NULL) == 0) {
+		trace_running = 1;
+	}
+}
+
+/*
+ * stops the flusher at unmount and writes out whatever is left
+ */
+static void trace_finish(void) {
+	if(trace_running) {
+		pthread_mutex_lock(&trace_lock);
+		trace_stop = 1;
+		pthread_cond_signal(&trace_wake);
+		pthread_mutex_unlock(&trace_lock);
+		pthread_join(tracer, NULL);
+		trace_running = 0;
+	}
+	trace_drain();
+}
+#endif
+
+//-o options of our own, the rest are passed on to FUSE
+struct cs1550_options
+{
+	char *durability;	//none, metadata or full
+	char *images;		//image paths separated by colons, the first gets the metadata
+	unsigned long stripe;	//stripe unit in bytes, a multiple of BLOCK_SIZE
+	char *trace;		//file to record every call in
+	int defrag;			//start a defragmenting pass at mount
+	long defrag_rate;	//blocks a second the defragmenter may move
+	int ram;			//hold the images in memory
+	long checkpoint;	//seconds between checkpoints, -1 when not given
+};
+
+static const struct fuse_opt cs1550_opts[] = {
+	{ "durability=%s", offsetof(struct cs1550_options, durability), 0 },
+	{ "images=%s", offsetof(struct cs1550_options, images), 0 },
+	{ "stripe=%lu", offsetof(struct cs1550_options, stripe), 0 },
+	{ "trace=%s", offsetof(struct cs1550_options, trace), 0 },
+	{ "defrag", offsetof(struct cs1550_options, defrag), 1 },
+	{ "defrag_rate=%ld", offsetof(struct cs1550_options, defrag_rate), 0 },
+	{ "ram", offsetof(struct cs1550_options, ram), 1 },
+	{ "checkpoint=%ld", offsetof(struct cs1550_options, checkpoint), 0 },
+	FUSE_OPT_END
+};
+
+/*
+ * sets up the images from -o images=, made absolute so they still resolve
+ * once FUSE has changed directory
+ * returns 0 on success, -1 on a bad list
+ */
+static int parse_images(char *list) {
+	char *saveptr = NULL;
+	char *path;
+
+	for(path = strtok_r(list, ":", &saveptr); path != NULL; path = strtok_r(NULL, ":", &saveptr)) {
+		if(num_members == MAX_MEMBERS) {
+			fprintf(stderr, "at most %d images\n", MAX_MEMBERS);
+			return -1;
+		}
+		members[num_members].path = realpath(path, NULL);
+		if(members[num_members].path == NULL) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			return -1;
+		}
+		num_members++;
+	}
+	if(num_members == 0) {
+		fprintf(stderr, "images needs at least one path\n");
+		return -1;
+	}
+	image_path = members[0].path;
+	return 0;
+}
+
+/*
+ * takes our own mount options out of args before FUSE sees them
+ * returns 0 on success, -1 on a bad option
+ */
+static int parse_options(struct fuse_args *args) {
+	struct cs1550_options opts;
+	int res = 0;
+
+	memset(&opts, 0, sizeof(struct cs1550_options));
+	opts.checkpoint = -1;
+	if(fuse_opt_parse(args, &opts, cs1550_opts, NULL) == -1) {
+		return -1;
+	}
+	if(opts.durability != NULL) {
+		if(strcmp(opts.durability, "none") == 0) {
+			durability = DURABILITY_NONE;
+		}
+		else if(strcmp(opts.durability, "metadata") == 0) {
+			durability = DURABILITY_METADATA;
+		}
+		else if(strcmp(opts.durability, "full") == 0) {
+			durability = DURABILITY_FULL;
+		}
+		else {
+			fprintf(stderr, "durability must be none, metadata or full\n");
+			res = -1;
+		}
+		free(opts.durability);
+	}
+	if(opts.images != NULL) {
+		if(parse_images(opts.images) == -1) {
+			res = -1;
+		}
+		free(opts.images);
+	}
+	if(opts.stripe != 0) {
+		if(opts.stripe % BLOCK_SIZE != 0) {
+			fprintf(stderr, "stripe must be a multiple of %d bytes\n", BLOCK_SIZE);
+			res = -1;
+		}
+		stripe_blocks = opts.stripe / BLOCK_SIZE;
+	}
+	if(opts.trace != NULL) {
+#ifdef CS1550_LOWLEVEL
+		fprintf(stderr, "trace needs the path API build\n");
+		res = -1;
+#else
+		if(trace_open(opts.trace) == -1) {
+			res = -1;
+		}
+#endif
+		free(opts.trace);
+	}
+	defrag_at_mount = opts.defrag;
+	if(opts.defrag_rate < 0) {
+		fprintf(stderr, "defrag_rate must not be negative\n");
+		res = -1;
+	}
+	else if(opts.defrag_rate != 0) {
+		defrag_rate = opts.defrag_rate;
+	}
+	ram_mode = opts.ram;
+	if(opts.checkpoint != -1) {
+		if(!ram_mode || opts.checkpoint < 0) {
+			fprintf(stderr, "checkpoint needs ram and a number of seconds\n");
+			res = -1;
+		}
+		checkpoint_secs = opts.checkpoint;
+	}
+	return res;
+}
+
+/*
+ * creates a directory (if entry's mode says so) or an empty file and links
+ * it into dir under entry->name
+ * fills in the rest of entry; returns 0 on success, negative errno on failure
+ */
+static int dir_create(long dir, cs1550_file_directory *entry) {
+	cs1550_file_directory existing;
+	long start_block;
+	int res;
+
+	if(dir_lookup(dir, entry->name, &existing) == 0) {
+		return -EEXIST;
+	}
+
+	if(S_ISDIR(entry->mode)) {
+		//allocate and write an empty directory next to its parent
+		start_block = create_directory_block(dir);
+	}
+	else {
+		//allocate a new inode next to its directory and write it before
+		//anything points at it
+		cs1550_inode new_inode;
+		memset(&new_inode, 0, sizeof(cs1550_inode));
+		new_inode.children = 0;
+		new_inode.magic_number = 0XFFFFFFFF;
+		start_block = claim_block(dir);
+		if(start_block != -1) {
+			put_inode(&new_inode, start_block);
+		}
+	}
+	if(start_block == -1) {
+		return -ENOSPC;
+	}
+	entry->hash = name_hash(entry->name);
+	entry->fsize = 0;
+	entry->nStartBlock = start_block;
+
+	res = dir_insert(dir, entry);
+	if(res != 0) {
+		update_bitmap("free", start_block / BLOCK_SIZE);
+	}
+	else {
+		__sync_fetch_and_add(&used_inodes, 1);
+	}
+	return res;
+}
+
+/*
+ * removes the empty directory entry from dir. With release set all of its
+ * blocks (index and leaves) are freed with one bitmap update; without, they
+ * are left for the orphan list to free later.
+ * returns 0 on success, negative errno on failure
+ */
+static int dir_rmdir(long dir, const cs1550_file_directory *entry, int release) {
+	cs1550_file_directory removed;
+	int *blocks = NULL;
+	int count = 0;
+	int size = 0;
+	int res;
+
+	pthread_rwlock_wrlock(&dir_lock);
+	res = dir_is_empty(entry->nStartBlock);
+	if(res == 1 && release) {
+		res = dir_collect_blocks(entry->nStartBlock, 0, &blocks, &count, &size);
+	}
+	else if(res == 1) {
+		res = 0;
+	}
+	else {
+		res = (res == 0) ? -ENOTEMPTY : -EIO;
+	}
+	if(res == 0) {
+		res = remove_entry(dir, entry->name, &removed);
+	}
+	pthread_rwlock_unlock(&dir_lock);
+
+	if(res == 0) {
+		update_bitmap_blocks("free", blocks, count);
+		__sync_fetch_and_sub(&used_inodes, 1);
+	}
+	free(blocks);
+	return res;
+}
+
+/*
+ * Passed each entry dir_stream finds, along with the offset that resumes
+ * after it. entry is NULL for "..". Returns nonzero to stop the walk.
+ */
+typedef int (*dir_emit_t)(void *ctx, const char *name,
+			 const cs1550_file_directory *entry, off_t next);
+
+/*
+ * Hands every entry of the directory dir to emit, starting after offset.
+ * Offsets 1 and 2 are . and .., entries after that are encoded from their
+ * hash and their position among equal hashes, so a resumed walk finds its
+ * place with one index walk, and entries added or removed elsewhere in
+ * between don't move it. Two limits: removing an entry from the run of
+ * equal hashes the walk stopped in shifts the positions after it, so one
+ * entry of that run can be skipped or repeated, and the position has 8
+ * bits, so a run of more than 255 equal hashes can't be resumed exactly.
+ * returns 0 on success, negative errno on failure
+ */
+static int dir_stream(const cs1550_file_directory *dir, off_t offset,
+			 dir_emit_t emit, void *ctx) {
+	cs1550_directory_node node;
+	cs1550_file_directory file;
+	long path_blocks[MAX_DIR_DEPTH + 1];
+	int slots[MAX_DIR_DEPTH];
+	unsigned int hash = 0;
+	unsigned int skip = 0;
+	unsigned int run_hash = 0;
+	unsigned int run_ordinal = 0;
+	long block;
+	unsigned int i;
+	int depth;
+
+	if(offset < 1 && emit(ctx, ".", dir, 1) != 0) {
+		return 0;
+	}
+	if(offset < 2 && emit(ctx, "..", NULL, 2) != 0) {
+		return 0;
+	}
+	//pick up after the entry the last call stopped at
+	if(offset >= READDIR_FIRST_ENTRY) {
+		hash = (unsigned int) ((offset - READDIR_FIRST_ENTRY) >> 8);
+		skip = (offset - READDIR_FIRST_ENTRY) & 0xff;
+	}
+
+	pthread_rwlock_rdlock(&dir_lock);
+	depth = find_leaf(dir->nStartBlock, hash, &node, path_blocks, slots);
+	block = (depth == -1) ? -1 : path_blocks[depth];
+	while(block > 0) {
+		//walked in place, one entry unpacked at a time
+		const char *p = node.leaf.entries;
+		for(i = 0; i < node.leaf.nFiles && i < MAX_FILES_IN_LEAF; i++) {
+			if(leaf_next(&node.leaf, &p, &file) == -1) {
+				break;
+			}
+			//entries with the same hash are told apart by their position
+			//in the run, which is never split across leaves
+			if(i == 0 || file.hash != run_hash) {
+				run_hash = file.hash;
+				run_ordinal = 0;
+			}
+			run_ordinal++;
+			if(file.hash < hash || (file.hash == hash && run_ordinal <= skip)) {
+				continue;
+			}
+
+			off_t next = READDIR_FIRST_ENTRY + (((off_t) file.hash << 8) | run_ordinal);
+			if(emit(ctx, file.name, &file, next) != 0) {
+				pthread_rwlock_unlock(&dir_lock);
+				return 0;
+			}
+		}
+		block = node.leaf.nNextLeaf;
+		if(block > 0 && get_dir_node(&node, block) != 1) {
+			block = -1;
+		}
+	}
+	pthread_rwlock_unlock(&dir_lock);
+
+	return (block == -1) ? -EIO : 0;
+}
+
+/*
+ * writes size bytes from buf into the file entry describes, starting at
+ * offset, and records the new size in entry and in dir (0 for a file that
+ * is no longer linked anywhere)
+ * Writing past the end of the file leaves a hole behind; only the blocks
+ * the write actually touches get allocated.
+ * caller holds the file's lock for writing, with entry's size read under it
+ * returns how many bytes were written, negative errno on failure
+ */
+static int write_blocks(long dir, cs1550_file_directory *entry, const char *buf,
+			 size_t size, off_t offset) {
+	cs1550_inode inode;
+	cs1550_disk_block edges[2];
+	int res;
+
+	if(size == 0) {
+		return 0;
+	}
+	if(offset + (off_t) size > MAX_FILE_SIZE) {
+		return -EFBIG;
+	}
+
+	//read in inode from disk
+	long inode_start = entry->nStartBlock;
+	get_inode(&inode, inode_start);
+	(*file_change(inode_start))++;
+
+	//any blocks skipped over are recorded as holes
+	unsigned int last_block = (offset + size - 1) / MAX_DATA_IN_BLOCK;
+	int changed = (inode.children <= last_block);
+	while(inode.children <= last_block) {
+		inode.pointers[inode.children] = 0;
+		inode.children = inode.children + 1;
+	}
+
+	//every block is written in one go at the end, so blocks on different
+	//images are written in parallel; only the first and last can be partial
+	struct cs1550_block_io *ios = (struct cs1550_block_io *) malloc(
+			(size / MAX_DATA_IN_BLOCK + 2) * sizeof(struct cs1550_block_io));
+	if(ios == NULL) {
+		return -ENOMEM;
+	}
+	int count = 0;
+	int partial = 0;
+
+	size_t written = 0;
+	while(written < size) {
+		unsigned int block_index = (offset + written) / MAX_DATA_IN_BLOCK;
+		size_t block_offset = (offset + written) % MAX_DATA_IN_BLOCK;
+		size_t chunk = MAX_DATA_IN_BLOCK - block_offset;
+		if(chunk > size - written) {
+			chunk = size - written;
+		}
+
+		if(inode.pointers[block_index] == 0) {
+			//keep the file contiguous: right after its previous block, or
+			//after the inode for the first one
+			long near = inode_start;
+			if(block_index > 0 && inode.pointers[block_index - 1] != 0) {
+				near = inode.pointers[block_index - 1];
+			}
+			int d_block = allocate_block(near);
+			if(d_block == -1) {
+				break;
+			}
+			inode.pointers[block_index] = (unsigned long) d_block * BLOCK_SIZE;
+			changed = 1;
+			if(chunk < MAX_DATA_IN_BLOCK) {
+				clear_disk_block(&edges[partial]);
+			}
+		}
+		else if(chunk < MAX_DATA_IN_BLOCK) {
+			get_disk_block(&edges[partial], inode.pointers[block_index]);
+		}
+
+		ios[count].start = inode.pointers[block_index];
+		if(chunk == MAX_DATA_IN_BLOCK) {
+			//whole blocks go straight from the caller's buffer
+			ios[count].buf = (char *) buf + written;
+		}
+		else {
+			memcpy(&edges[partial].data[block_offset], buf + written, chunk);
+			ios[count].buf = edges[partial].data;
+			partial++;
+		}
+		count++;
+		written += chunk;
+	}
+	res = data_io(ios, count, 1);
+	free(ios);
+
+	//update file size
+	int grew = (offset + (off_t) written > (off_t) entry->fsize);
+	if(grew) {
+		entry->fsize = offset + written;
+	}
+
+	//write updated inode, then the directory holding the file size. A write
+	//into blocks already there changes neither, and leaves an fdatasync
+	//nothing but the data to sync.
+	if(changed) {
+		put_inode(&inode, inode_start);
+	}
+	if(grew) {
+		//the inode's dirty bit stands for its size too, see sync_file
+		mark_dirty(inode_start, 1);
+		if(dir != 0) {
+			dir_update(dir, entry);
+		}
+	}
+
+	if(res != 0) {
+		return res;
+	}
+	//out of space before anything was written
+	if(written == 0) {
+		return -ENOSPC;
+	}
+	return written;
+}
+
+/*
+ * makes the file entry describes size bytes long, recording the new size
+ * in entry and in dir (0 for a file that is no longer linked anywhere)
+ * Shrinking frees every block past the new end with a single bitmap update.
+ * Growing only records holes (null pointers), so nothing is allocated or
+ * written until data actually lands there.
+ * caller holds the file's lock for writing, with entry's size read under it
+ * returns 0 on success, negative errno on failure
+ */
+static int truncate_blocks(long dir, cs1550_file_directory *entry, off_t size) {
+	cs1550_inode inode;
+	cs1550_disk_block cur_disk_block;
+	unsigned int i;
+
+	if(size < 0) {
+		return -EINVAL;
+	}
+	if(size > MAX_FILE_SIZE) {
+		return -EFBIG;
+	}
+
+	long inode_start = entry->nStartBlock;
+	off_t f_size = entry->fsize;
+	get_inode(&inode, inode_start);
+	(*file_change(inode_start))++;
+
+	unsigned int keep = (size + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+	int freed[NUM_POINTERS_IN_INODE];
+	int num_freed = 0;
+
+	if(keep < inode.children) {
+		for(i = keep; i < inode.children; i++) {
+			if(inode.pointers[i] != 0) {
+				freed[num_freed++] = inode.pointers[i] / BLOCK_SIZE;
+			}
+			inode.pointers[i] = 0;
+		}
+		inode.children = keep;
+	}
+	else {
+		while(inode.children < keep) {
+			inode.pointers[inode.children] = 0;
+			inode.children = inode.children + 1;
+		}
+	}
+
+	//bytes past the new end of a partial last block must read back as
+	//zeros if the file grows again
+	size_t tail = size % MAX_DATA_IN_BLOCK;
+	if(size < f_size && tail != 0 && inode.pointers[keep-1] != 0) {
+		get_disk_block(&cur_disk_block, inode.pointers[keep-1]);
+		memset(&cur_disk_block.data[tail], 0, MAX_DATA_IN_BLOCK - tail);
+		put_disk_block(&cur_disk_block, inode.pointers[keep-1]);
+	}
+
+	entry->fsize = size;
+	put_inode(&inode, inode_start);
+	if(dir != 0) {
+		dir_update(dir, entry);
+	}
+
+	//only release the blocks once nothing points at them anymore
+	update_bitmap_blocks("free", freed, num_freed);
+
+	return 0;
+}
+
+#ifndef CS1550_LOWLEVEL
+/*
+ * picks up the size dir records for entry now, which a write or truncate
+ * that held the file's lock before the caller may have changed
+ * caller holds the file's lock for writing
+ */
+static void refresh_size(long dir, cs1550_file_directory *entry) {
+	cs1550_file_directory current;
+
+	if(dir != 0 && dir_lookup(dir, entry->name, &current) == 0 &&
+			current.nStartBlock == entry->nStartBlock) {
+		entry->fsize = current.fsize;
+	}
+}
+
+/*
+ * write_blocks with the file's lock held, so writes and truncates of the
+ * same file take turns at its inode and size instead of undoing each
+ * other's pointer updates
+ */
+static int file_write(long dir, cs1550_file_directory *entry, const char *buf,
+			 size_t size, off_t offset) {
+	pthread_rwlock_t *lock = file_lock(entry->nStartBlock);
+
+	pthread_rwlock_wrlock(lock);
+	refresh_size(dir, entry);
+	int res = write_blocks(dir, entry, buf, size, offset);
+	pthread_rwlock_unlock(lock);
+	return res;
+}
+
+/*
+ * truncate_blocks with the file's lock held, see file_write
+ */
+static int file_truncate(long dir, cs1550_file_directory *entry, off_t size) {
+	pthread_rwlock_t *lock = file_lock(entry->nStartBlock);
+
+	pthread_rwlock_wrlock(lock);
+	refresh_size(dir, entry);
+	int res = truncate_blocks(dir, entry, size);
+	pthread_rwlock_unlock(lock);
+	return res;
+}
+#endif
+
+#ifdef CS1550_LSEEK
+/*
+ * SEEK_DATA/SEEK_HOLE in the file entry describes. Holes are null pointers
+ * in the inode, and there is always an implicit hole at the end of the file.
+ * returns the offset found, negative errno on failure
+ */
+static off_t file_lseek(const cs1550_file_directory *entry, off_t off, int whence) {
+	cs1550_inode inode;
+	unsigned int i;
+
+	if(whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return -EINVAL;
+	}
+	off_t f_size = entry->fsize;
+	if(off < 0 || off >= f_size) {
+		return -ENXIO;
+	}
+	pthread_rwlock_rdlock(file_lock(entry->nStartBlock));
+	get_inode(&inode, entry->nStartBlock);
+	pthread_rwlock_unlock(file_lock(entry->nStartBlock));
+
+	for(i = off / MAX_DATA_IN_BLOCK; i < inode.children; i++) {
+		int is_hole = (inode.pointers[i] == 0);
+		if(is_hole == (whence == SEEK_HOLE)) {
+			off_t found = (off_t) i * MAX_DATA_IN_BLOCK;
+			if(found < off) {
+				found = off;
+			}
+			if(found >= f_size) {
+				break;
+			}
+			return found;
+		}
+	}
+
+	if(whence == SEEK_HOLE) {
+		return f_size;
+	}
+	return -ENXIO;
+}
+#endif
+
+/*
+ * whether a file's blocks (holes aside) are out of order or have gaps
+ * between them
+ */
+static int fragmented(const cs1550_inode *inode) {
+	unsigned long prev = 0;
+	unsigned int i;
+
+	for(i = 0; i < inode->children; i++) {
+		if(inode->pointers[i] == 0) {
+			continue;
+		}
+		if(prev != 0 && inode->pointers[i] != prev + BLOCK_SIZE) {
+			return 1;
+		}
+		prev = inode->pointers[i];
+	}
+	return 0;
+}
+
+/*
+ * finds n free blocks in a row, at or after goal if there are any there,
+ * and marks them used. The bitmap is searched without locks; the groups a
+ * candidate run spans are then locked, lowest first, and checked again.
+ * returns the first block, -1 if there is no run that long
+ */
+static int claim_run(int n, int goal) {
+	int wrapped = 0;
+	int block, k, g;
+
+	if(goal < 2 || goal > last_block) {
+		goal = 2;
+	}
+	block = goal;
+	while(1) {
+		if(block + n - 1 > last_block || (wrapped && block >= goal)) {
+			if(wrapped) {
+				return -1;
+			}
+			wrapped = 1;
+			block = 2;
+			continue;
+		}
+		for(k = 0; k < n && !block_used(block + k); k++) {
+		}
+		if(k < n) {
+			block += k + 1;
+			continue;
+		}
+
+		int first_group = (block - 1) / GROUP_BLOCKS;
+		int last_group = (block + n - 2) / GROUP_BLOCKS;
+		for(g = first_group; g <= last_group; g++) {
+			pthread_mutex_lock(&groups[g].lock);
+		}
+		for(k = 0; k < n && !block_used(block + k); k++) {
+		}
+		if(k == n) {
+			for(k = 0; k < n; k++) {
+				mark_block(block + k, 1);
+			}
+		}
+		for(g = first_group; g <= last_group; g++) {
+			if(k == n) {
+				put_group(g);
+			}
+			pthread_mutex_unlock(&groups[g].lock);
+		}
+		if(k == n) {
+			return block;
+		}
+		block += k + 1;
+	}
+}
+
+/*
+ * whether unmount has asked the defragmenter to stop
+ */
+static int defrag_stopping(void) {
+	pthread_mutex_lock(&defrag_lock);
+	int stop = defrag_stop;
+	pthread_mutex_unlock(&defrag_lock);
+	return stop;
+}
+
+/*
+ * waits long enough after moving some blocks to keep to -o defrag_rate=
+ */
+static void defrag_throttle(int moved) {
+	struct timeval now;
+	struct timespec deadline;
+
+	if(moved <= 0 || defrag_rate <= 0) {
+		return;
+	}
+	long long wait = moved * 1000000000LL / defrag_rate;
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + wait / 1000000000LL;
+	deadline.tv_nsec = now.tv_usec * 1000 + wait % 1000000000LL;
+	if(deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&defrag_lock);
+	while(!defrag_stop) {
+		if(pthread_cond_timedwait(&defrag_wake, &defrag_lock, &deadline) != 0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&defrag_lock);
+}
+
+/*
+ * moves the blocks behind pointers from to from + DEFRAG_RUN of a file into
+ * one run of free blocks starting at *goal (where the previous run ended),
+ * unless they already are there, and moves *goal past them
+ * The copy and the switch happen under the file's lock, so readers and
+ * writers never see a block half moved. The copies are synced in between
+ * without the lock; if the file changed meanwhile they are thrown away.
+ * One inode write swaps every pointer: a crash leaves either the old
+ * blocks in use or the new ones, leaking the other set at worst.
+ * returns how many blocks were moved, -1 to give up on the file
+ */
+static int defrag_chunk(long dir, const cs1550_file_directory *file, unsigned int from, long *goal) {
+	cs1550_file_directory entry;
+	cs1550_inode inode;
+	struct cs1550_block_io ios[DEFRAG_RUN];
+	unsigned int slots[DEFRAG_RUN];
+	int blocks[DEFRAG_RUN];
+	pthread_rwlock_t *lock = file_lock(file->nStartBlock);
+	int in_place = 1;
+	int n = 0;
+	int res, k;
+	unsigned int i;
+
+	pthread_rwlock_wrlock(lock);
+	//the file may have been unlinked, and its blocks freed, since the walk
+	//found it
+	if(dir_lookup(dir, file->name, &entry) != 0 || entry.nStartBlock != file->nStartBlock ||
+			get_inode(&inode, entry.nStartBlock) != 1 || from >= inode.children) {
+		pthread_rwlock_unlock(lock);
+		return -1;
+	}
+	long next = *goal;
+	for(i = from; i < inode.children && i < from + DEFRAG_RUN; i++) {
+		if(inode.pointers[i] == 0) {
+			continue;
+		}
+		if((long) inode.pointers[i] != next) {
+			in_place = 0;
+		}
+		next = inode.pointers[i] + BLOCK_SIZE;
+		slots[n++] = i;
+	}
+	if(in_place) {
+		*goal = next;
+		pthread_rwlock_unlock(lock);
+		return 0;
+	}
+
+	int first = claim_run(n, *goal / BLOCK_SIZE);
+	char *buf = (char *) malloc((size_t) n * BLOCK_SIZE);
+	if(first == -1 || buf == NULL) {
+		if(first != -1) {
+			for(k = 0; k < n; k++) {
+				blocks[k] = first + k;
+			}
+			update_bitmap_blocks("free", blocks, n);
+		}
+		free(buf);
+		pthread_rwlock_unlock(lock);
+		return -1;
+	}
+
+	//copy into the new run, and make the copies durable before anything
+	//points at them
+	for(k = 0; k < n; k++) {
+		ios[k].start = inode.pointers[slots[k]];
+		ios[k].buf = buf + (size_t) k * BLOCK_SIZE;
+	}
+	res = data_io(ios, n, 0);
+	for(k = 0; k < n; k++) {
+		ios[k].start = (long) (first + k) * BLOCK_SIZE;
+	}
+	if(res == 0) {
+		res = data_io(ios, n, 1);
+	}
+	//a checkpoint of an image in memory is a snapshot of one instant, so it
+	//can never have the new pointers without the copies
+	if(res == 0 && members[0].ram == NULL) {
+		unsigned long changes = *file_change(entry.nStartBlock);
+		unsigned long copied[DEFRAG_RUN];
+		long run[DEFRAG_RUN];
+		for(k = 0; k < n; k++) {
+			copied[k] = inode.pointers[slots[k]];
+			run[k] = ios[k].start;
+		}
+		pthread_rwlock_unlock(lock);
+		res = sync_image(run, n, 0);
+		pthread_rwlock_wrlock(lock);
+		//a write, truncate or unlink since the copy leaves it stale
+		if(res == 0 && (*file_change(entry.nStartBlock) != changes ||
+				dir_lookup(dir, file->name, &entry) != 0 || entry.nStartBlock != file->nStartBlock ||
+				get_inode(&inode, entry.nStartBlock) != 1)) {
+			res = -EAGAIN;
+		}
+		for(k = 0; k < n && res == 0; k++) {
+			if(slots[k] >= inode.children || inode.pointers[slots[k]] != copied[k]) {
+				res = -EAGAIN;
+			}
+		}
+	}
+
+	for(k = 0; k < n; k++) {
+		if(res == 0) {
+			blocks[k] = inode.pointers[slots[k]] / BLOCK_SIZE;
+			inode.pointers[slots[k]] = (unsigned long) (first + k) * BLOCK_SIZE;
+		}
+		else {
+			blocks[k] = first + k;
+		}
+	}
+	if(res == 0) {
+		put_inode(&inode, entry.nStartBlock);
+		*goal = (long) (first + n) * BLOCK_SIZE;
+	}
+	//whichever set of blocks nothing points at anymore
+	update_bitmap_blocks("free", blocks, n);
+	pthread_rwlock_unlock(lock);
+
+	free(buf);
+	return (res == 0) ? n : -1;
+}
+
+/*
+ * makes one file's blocks contiguous, a DEFRAG_RUN at a time, right after
+ * its inode if there is room there (where allocate_block would have put
+ * them), or wherever there is a long enough free run if not
+ */
+static void defrag_file(long dir, const cs1550_file_directory *file) {
+	cs1550_inode inode;
+	pthread_rwlock_t *lock = file_lock(file->nStartBlock);
+	long goal = file->nStartBlock + BLOCK_SIZE;
+	unsigned int from;
+	long total = 0;
+
+	pthread_rwlock_rdlock(lock);
+	int res = get_inode(&inode, file->nStartBlock);
+	pthread_rwlock_unlock(lock);
+	if(res != 1 || inode.magic_number != 0xFFFFFFFF || inode.children > NUM_POINTERS_IN_INODE ||
+			!fragmented(&inode)) {
+		return;
+	}
+
+	for(from = 0; from < inode.children && !defrag_stopping(); from += DEFRAG_RUN) {
+		int moved = defrag_chunk(dir, file, from, &goal);
+		if(moved == -1) {
+			break;
+		}
+		total += moved;
+		defrag_throttle(moved);
+	}
+
+	if(total > 0) {
+		pthread_mutex_lock(&defrag_lock);
+		defrag_status.files++;
+		defrag_status.blocks += total;
+		pthread_mutex_unlock(&defrag_lock);
+	}
+}
+
+//A handful of entries taken from a directory at a time
+struct defrag_batch
+{
+	cs1550_file_directory entries[DEFRAG_BATCH];
+	int count;
+	off_t next;		//where dir_stream picks up after them
+};
+
+static int defrag_collect(void *ctx, const char *name, const cs1550_file_directory *entry, off_t next) {
+	struct defrag_batch *batch = (struct defrag_batch *) ctx;
+	(void) name;
+
+	if(batch->count == DEFRAG_BATCH) {
+		return 1;
+	}
+	batch->entries[batch->count++] = *entry;
+	batch->next = next;
+	return 0;
+}
+
+/*
+ * walks every directory, DEFRAG_BATCH entries at a time so that the
+ * directory lock is never held for long, and defragments every file
+ */
+static void defrag_pass(void) {
+	cs1550_file_directory dir;
+	int todo_count = 1;
+	int todo_size = 64;
+	int i;
+
+	long *todo = (long *) malloc(todo_size * sizeof(long));
+	struct defrag_batch *batch = (struct defrag_batch *) malloc(sizeof(struct defrag_batch));
+	if(todo == NULL || batch == NULL) {
+		free(todo);
+		free(batch);
+		return;
+	}
+	todo[0] = root_tree;
+
+	while(todo_count > 0 && !defrag_stopping()) {
+		memset(&dir, 0, sizeof(cs1550_file_directory));
+		dir.nStartBlock = todo[--todo_count];
+		dir.mode = S_IFDIR;
+
+		//offset 2 skips . and ..
+		off_t offset = 2;
+		do {
+			batch->count = 0;
+			if(dir_stream(&dir, offset, defrag_collect, batch) != 0) {
+				break;
+			}
+			for(i = 0; i < batch->count; i++) {
+				if(!S_ISDIR(batch->entries[i].mode)) {
+					defrag_file(dir.nStartBlock, &batch->entries[i]);
+					continue;
+				}
+				if(todo_count == todo_size) {
+					long *more = (long *) realloc(todo, todo_size * 2 * sizeof(long));
+					if(more == NULL) {
+						continue;
+					}
+					todo = more;
+					todo_size *= 2;
+				}
+				todo[todo_count++] = batch->entries[i].nStartBlock;
+			}
+			offset = batch->next;
+		} while(batch->count == DEFRAG_BATCH && !defrag_stopping());
+	}
+	free(todo);
+	free(batch);
+}
+
+/*
+ * background thread that runs a defragmenting pass whenever one is asked
+ * for, until unmount
+ */
+static void *defrag_thread(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&defrag_lock);
+	while(!defrag_stop) {
+		if(!defrag_pending) {
+			pthread_cond_wait(&defrag_wake, &defrag_lock);
+			continue;
+		}
+		defrag_pending = 0;
+		defrag_status.active = 1;
+		pthread_mutex_unlock(&defrag_lock);
+
+		defrag_pass();
+
+		pthread_mutex_lock(&defrag_lock);
+		defrag_status.active = 0;
+		defrag_status.passes++;
+	}
+	pthread_mutex_unlock(&defrag_lock);
+
+	return NULL;
+}
+
+#if FUSE_USE_VERSION >= 28
+/*
+ * handles the defragmenter's ioctls: CS1550_IOC_DEFRAG asks for a pass
+ * (another one after the current one, if one is running) and
+ * CS1550_IOC_DEFRAG_STATUS copies its progress into data
+ * returns 0 on success, -ENOTTY for any other ioctl
+ */
+static int defrag_ioctl(unsigned int cmd, void *data) {
+	switch(cmd) {
+	case CS1550_IOC_DEFRAG:
+		pthread_mutex_lock(&defrag_lock);
+		defrag_pending = 1;
+		pthread_cond_signal(&defrag_wake);
+		pthread_mutex_unlock(&defrag_lock);
+		return 0;
+	case CS1550_IOC_DEFRAG_STATUS:
+		pthread_mutex_lock(&defrag_lock);
+		memcpy(data, &defrag_status, sizeof(struct cs1550_defrag_status));
+		pthread_mutex_unlock(&defrag_lock);
+		return 0;
+	}
+	return -ENOTTY;
+}
+#endif
+
+/*
+ * starts the defragmenter at mount, with a pass right away for -o defrag
+ */
+static void defrag_start(void) {
+	memset(&defrag_status, 0, sizeof(struct cs1550_defrag_status));
+	defrag_stop = 0;
+	defrag_pending = defrag_at_mount;
+	if(pthread_create(&defragger, NULL, defrag_thread, NULL) == 0) {
+		defrag_running = 1;
+	}
+}
+
+/*
+ * stops the defragmenter at unmount, between two chunks if it is busy
+ */
+static void defrag_finish(void) {
+	if(defrag_running) {
+		pthread_mutex_lock(&defrag_lock);
+		defrag_stop = 1;
+		pthread_cond_broadcast(&defrag_wake);
+		pthread_mutex_unlock(&defrag_lock);
+		pthread_join(defragger, NULL);
+		defrag_running = 0;
+	}
+}
+
+/*
+ * sets up the image at mount: opens the images (and reads them into memory
+ * for -o ram), formats a blank .disk,
+ * loads the orphan list and finishes any frees a crash interrupted, and
+ * starts the reclaimer and the defragmenter
+ * returns 0 on success, -1 if .disk holds something else
+ */
+static int mount_image(void) {
+	if(open_members() == -1) {
+		return -1;
+	}
+	if(ram_mode && load_ram() == -1) {
+		close_members();
+		return -1;
+	}
+	if(prepare_image() == -1) {
+		close_members();
+		return -1;
+	}
+	start_members();
+	start_checkpointer();
+	//finish whatever a crash interrupted before anything can be allocated
+	load_orphans();
+	reclaim_orphans();
+	reclaimer_stop = 0;
+	if(pthread_create(&reclaimer, NULL, reclaim_thread, NULL) == 0) {
+		reclaimer_running = 1;
+	}
+	defrag_start();
+	return 0;
+}
+
+/*
+ * stops the defragmenter and the reclaimer at unmount, frees whatever is
+ * still queued and closes the images
+ */
+static void unmount_image(void) {
+	defrag_finish();
+	if(reclaimer_running) {
+		pthread_mutex_lock(&orphan_lock);
+		reclaimer_stop = 1;
+		pthread_cond_signal(&orphan_added);
+		pthread_mutex_unlock(&orphan_lock);
+		pthread_join(reclaimer, NULL);
+		reclaimer_running = 0;
+	}
+
+	reclaim_orphans();
+	save_counters();
+	close_members();
+}
+
+
+/******************************************************************************
+ *
+ *  END OF HELPER FUNCTIONS
+ *
+ *****************************************************************************/
+
+#ifndef CS1550_LOWLEVEL
+
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not. 
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int cs1550_getattr(const char *path, struct stat *stbuf)
+{
+	cs1550_file_directory entry;
+	long dir;
+	int res;
+
+	memset(stbuf, 0, sizeof(struct stat));
+	res = resolve_path(path, &entry, &dir);
+	if(res != 0) {
+		return res;
+	}
+	fill_stat(&entry, stbuf);
+	return 0;
+}
+
+//where readdir_stream's entries go
+struct cs1550_readdir_buf
+{
+	void *buf;
+	fuse_fill_dir_t filler;
+	int plus;	//hand back attributes readdirplus style
+};
+
+/*
+ * passes one entry on to the FUSE filler with its stat filled in
+ * returns nonzero once the filler's buffer is full
+ */
+static int fill_dir_entry(void *ctx, const char *name,
+			 const cs1550_file_directory *entry, off_t next) {
+	struct cs1550_readdir_buf *rb = (struct cs1550_readdir_buf *) ctx;
+	struct stat st;
+
+	if(entry == NULL) {
+		return fill_dir(rb->filler, rb->buf, name, NULL, next, 0);
+	}
+	fill_stat(entry, &st);
+	return fill_dir(rb->filler, rb->buf, name, &st, next, rb->plus);
+}
+
+/*
+ * Streams a directory's entries into filler starting after offset, and
+ * stops as soon as filler says its buffer is full. Every entry comes with
+ * its stat filled in from the directory entry, so with readdirplus (plus)
+ * the kernel needs no getattr per entry afterwards.
+ */
+static int readdir_stream(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, int plus)
+{
+	struct cs1550_readdir_buf rb;
+	cs1550_file_directory entry;
+	long dir;
+	int res;
+
+	res = resolve_path(path, &entry, &dir);
+	if(res != 0) {
+		return res;
+	}
+	if(!S_ISDIR(entry.mode)) {
+		return -ENOTDIR;
+	}
+
+	rb.buf = buf;
+	rb.filler = filler;
+	rb.plus = plus;
+	return dir_stream(&entry, offset, fill_dir_entry, &rb);
+}
+
+#if FUSE_USE_VERSION < 30
+//FUSE 3 builds use cs1550_readdir3 instead
+
+/* 
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ * Entries come back in hash order, and offset resumes where a previous call
+ * left off.
+ */
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	//Since we're building with -Wall (all warnings reported) we need
+	//to "use" every parameter, so let's just cast them to void to
+	//satisfy the compiler
+	(void) fi;
+
+	return readdir_stream(path, buf, filler, offset, 0);
+}
+#endif
+
+/* 
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+	(void) mode;
+
+	cs1550_file_directory entry;
+	long dir;
+	int res;
+
+	memset(&entry, 0, sizeof(cs1550_file_directory));
+	res = resolve_parent(path, &dir, entry.name);
+	if(res != 0) {
+		return res;
+	}
+	entry.mode = S_IFDIR | 0755;
+	return dir_create(dir, &entry);
+}
+
+/* 
+ * Removes a directory. It has to be empty; all of its blocks (index and
+ * leaves) are freed with one bitmap update.
+ */
+static int cs1550_rmdir(const char *path)
+{
+	cs1550_file_directory entry;
+	long dir;
+	int res;
+
+	res = resolve_path(path, &entry, &dir);
+	if(res != 0) {
+		return res;
+	}
+	if(!S_ISDIR(entry.mode)) {
+		return -ENOTDIR;
+	}
+	//can't remove the root
+	if(dir == 0) {
+		return -EBUSY;
+	}
+	return dir_rmdir(dir, &entry, 1);
+}
+
+/* 
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ */
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	(void) mode;
+	(void) dev;
+
+	cs1550_file_directory entry;
+	long dir;
+	int res;
+
+	memset(&entry, 0, sizeof(cs1550_file_directory));
+	res = resolve_parent(path, &dir, entry.name);
+	if(res != 0) {
+		return res;
+	}
+	entry.mode = S_IFREG | 0666;
+	return dir_create(dir, &entry);
+}
+
+/*
+ * Deletes a file
+ * The file is detached from its directory right away; its blocks are freed
+ * later, in batches, by the reclaimer thread.
+ */
+static int cs1550_unlink(const char *path)
+{
+	cs1550_file_directory entry;
+	long dir;
+
+	int res = lookup_file(path, &entry, &dir);
+	if(res != 0) {
+		return res;
+	}
+
+	//take the entry out of its directory before the inode becomes an
+	//orphan, so a crash in between leaks the file's blocks instead of
+	//freeing a live file
+	res = dir_remove(dir, entry.name, &entry);
+	if(res != 0) {
+		return res;
+	}
+	long inode_start = entry.nStartBlock;
+	add_orphan(inode_start);
+
+	return 0;
+}
+
+/* 
+ * Read size bytes from file into buf starting from offset
+ * Holes (null pointers, or blocks past the last child) read back as zeros
+ * without touching the disk.
+ */
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	cs1550_file_directory entry;
+	long dir;
+
+	off_t f_size;
+	cs1550_inode inode;
+	cs1550_disk_block edges[2];
+	struct
+	{
+		char *to;
+		size_t from;
+		size_t len;
+	} copies[2];
+
+	int res = lookup_file(path, &entry, &dir);
+	if(res != 0) {
+		return res;
+	}
+	f_size = entry.fsize;
+
+	//nothing to read at or past the end of the file
+	if(offset >= f_size) {
+		return 0;
+	}
+	if((off_t) size > f_size - offset) {
+		size = f_size - offset;
+	}
+
+	//every block is read in one go, so blocks on different images are read
+	//in parallel; only the first and last can be partial
+	struct cs1550_block_io *ios = (struct cs1550_block_io *) malloc(
+			(size / MAX_DATA_IN_BLOCK + 2) * sizeof(struct cs1550_block_io));
+	if(ios == NULL) {
+		return -ENOMEM;
+	}
+
+	//read in inode from disk, and keep the defragmenter from moving the
+	//blocks until they have been read
+	pthread_rwlock_t *lock = file_lock(entry.nStartBlock);
+	pthread_rwlock_rdlock(lock);
+	get_inode(&inode, entry.nStartBlock);
+	int count = 0;
+	int partial = 0;
+	int i;
+
+	size_t bytes_read = 0;
+	while(bytes_read < size) {
+		unsigned int block_index = (offset + bytes_read) / MAX_DATA_IN_BLOCK;
+		size_t block_offset = (offset + bytes_read) % MAX_DATA_IN_BLOCK;
+		size_t chunk = MAX_DATA_IN_BLOCK - block_offset;
+		if(chunk > size - bytes_read) {
+			chunk = size - bytes_read;
+		}
+
+		if(block_index >= inode.children || inode.pointers[block_index] == 0) {
+			memset(buf + bytes_read, 0, chunk);
+		}
+		else if(chunk == MAX_DATA_IN_BLOCK) {
+			//whole blocks go straight into the caller's buffer
+			ios[count].start = inode.pointers[block_index];
+			ios[count++].buf = buf + bytes_read;
+		}
+		else {
+			ios[count].start = inode.pointers[block_index];
+			ios[count++].buf = edges[partial].data;
+			copies[partial].to = buf + bytes_read;
+			copies[partial].from = block_offset;
+			copies[partial].len = chunk;
+			partial++;
+		}
+		bytes_read += chunk;
+	}
+	res = data_io(ios, count, 0);
+	pthread_rwlock_unlock(lock);
+	free(ios);
+	if(res != 0) {
+		return res;
+	}
+	for(i = 0; i < partial; i++) {
+		memcpy(copies[i].to, &edges[i].data[copies[i].from], copies[i].len);
+	}
+
+	//set size and return
+	return size;
+}
+
+/* 
+ * Write size bytes from buf into file starting from offset
+ *
+ */
+static int cs1550_write(const char *path, const char *buf, size_t size, 
+			  off_t offset, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	cs1550_file_directory entry;
+	long dir;
+
+	int res = lookup_file(path, &entry, &dir);
+	//check to make sure path exists
+	if(res != 0) {
+		return res;
+	}
+	return file_write(dir, &entry, buf, size, offset);
+}
+
+/*
+ * truncate is called when a new file is created (with a 0 size), when an
+ * existing file is opened with O_TRUNC, or when it is made shorter or longer.
+ */
+static int cs1550_truncate(const char *path, off_t size)
+{
+	cs1550_file_directory entry;
+	long dir;
+
+	int res = lookup_file(path, &entry, &dir);
+	if(res != 0) {
+		return res;
+	}
+	return file_truncate(dir, &entry, size);
+}
+
+#ifdef CS1550_LSEEK
+/*
+ * SEEK_DATA/SEEK_HOLE support
+ */
+static off_t cs1550_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	cs1550_file_directory entry;
+	long dir;
+
+	int res = lookup_file(path, &entry, &dir);
+	if(res != 0) {
+		return res;
+	}
+	return file_lseek(&entry, off, whence);
+}
+#endif
+
+
+/* 
+ * Called when we open a file
+ *
+ */
+static int cs1550_open(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) fi;
+    /*
+        //if we can't find the desired file, return an error
+        return -ENOENT;
+    */
+
+    //It's not really necessary for this project to anything in open
+
+    /* We're not going to worry about permissions for this project, but 
+	   if we were and we don't have them to the file we should return an error
+
+        return -EACCES;
+    */
+
+    return 0; //success!
+}
+
+/*
+ * Called when close is called on a file descriptor, but because it might
+ * have been dup'ed, this isn't a guarantee we won't ever need the file 
+ * again. For us, return success simply to avoid the unimplemented error
+ * in the debug log.
+ */
+static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) fi;
+
+	return 0; //success!
+}
+
+/*
+ * Called for fsync and fdatasync. How much that makes durable is up to the
+ * durability mount option; only this file's data is synced, never anyone
+ * else's. With datasync the metadata is skipped too, unless the file's
+ * size or blocks changed since it was last synced. A directory is synced
+ * the way fsyncdir does it.
+ */
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	cs1550_file_directory entry;
+	long dir;
+
+	int res = resolve_path(path, &entry, &dir);
+	if(res != 0) {
+		return res;
+	}
+	if(S_ISDIR(entry.mode)) {
+		return sync_image(NULL, 0, 1);
+	}
+	return sync_file(entry.nStartBlock, datasync);
+}
+
+/*
+ * fsync on a directory, which makes its entries durable
+ */
+static int cs1550_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void) datasync;
+	(void) fi;
+
+	cs1550_file_directory entry;
+	long dir;
+
+	int res = resolve_path(path, &entry, &dir);
+	if(res != 0) {
+		return res;
+	}
+	if(!S_ISDIR(entry.mode)) {
+		return -ENOTDIR;
+	}
+	return sync_image(NULL, 0, 1);
+}
+
+/*
+ * Called for statfs (df and the like). Answered from counters kept up to
+ * date as blocks and files come and go, so it costs next to nothing.
+ */
+static int cs1550_statfs(const char *path, struct statvfs *stbuf)
+{
+	(void) path;
+
+	fill_statfs(stbuf);
+	return 0;
+}
+
+#if FUSE_USE_VERSION >= 28
+/*
+ * Called for ioctl on any file or directory. The only ones known are the
+ * defragmenter's, see defrag_ioctl.
+ */
+static int cs1550_ioctl(const char *path, ioctl_cmd_t cmd, void *arg,
+			 struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	(void) path;
+	(void) arg;
+	(void) fi;
+
+	//a 32 bit caller on a 64 bit kernel
+	if(flags & FUSE_IOCTL_COMPAT) {
+		return -ENOSYS;
+	}
+	return defrag_ioctl(cmd, data);
+}
+#endif
+
+/*
+ * Called once the filesystem is mounted. Sets up a blank .disk, loads the
+ * orphan list, finishes any frees a crash interrupted and starts the
+ * reclaimer and the defragmenter.
+ */
+static void *cs1550_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+
+	if(mount_image() == -1) {
+		fprintf(stderr, ".disk is not a blank or cs1550 formatted image\n");
+		fuse_exit(fuse_get_context()->fuse);
+	}
+	return NULL;
+}
+
+/*
+ * Called at unmount. Stops the defragmenter and the reclaimer and frees
+ * whatever is still queued.
+ */
+static void cs1550_destroy(void *private_data)
+{
+	(void) private_data;
+
+	unmount_image();
+}
+
+#if FUSE_USE_VERSION >= 30
+/*
+ * FUSE 3 passes an open file handle and flags to these. Everything is looked
+ * up by path here, so they just forward to the FUSE 2 versions.
+ */
+static int cs1550_getattr3(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+	(void) fi;
+	return cs1550_getattr(path, stbuf);
+}
+
+static int cs1550_readdir3(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	(void) fi;
+	return readdir_stream(path, buf, filler, offset, (flags & FUSE_READDIR_PLUS) != 0);
+}
+
+static int cs1550_truncate3(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	(void) fi;
+	return cs1550_truncate(path, size);
+}
+
+static void *cs1550_init3(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	(void) cfg;
+	return cs1550_init(conn);
+}
+#endif
+
+//register our new functions as the implementations of the syscalls
+static struct fuse_operations hello_oper = {
+#if FUSE_USE_VERSION >= 30
+    .getattr	= cs1550_getattr3,
+    .readdir	= cs1550_readdir3,
+	.truncate = cs1550_truncate3,
+	.init	= cs1550_init3,
+#else
+    .getattr	= cs1550_getattr,
+    .readdir	= cs1550_readdir,
+	.truncate = cs1550_truncate,
+	.init	= cs1550_init,
+#endif
+	.destroy	= cs1550_destroy,
+    .mkdir	= cs1550_mkdir,
+	.rmdir = cs1550_rmdir,
+    .read	= cs1550_read,
+    .write	= cs1550_write,
+	.mknod	= cs1550_mknod,
+	.unlink = cs1550_unlink,
+	.flush = cs1550_flush,
+	.fsync	= cs1550_fsync,
+	.fsyncdir	= cs1550_fsyncdir,
+	.open	= cs1550_open,
+	.statfs	= cs1550_statfs,
+#if FUSE_USE_VERSION >= 28
+	.ioctl	= cs1550_ioctl,
+#endif
+#ifdef CS1550_LSEEK
+	.lseek	= cs1550_lseek,
+#endif
+};
+
+/*
+ * -o trace= swaps every operation in hello_oper for one of these, which
+ * time the real one and record the call. Without it nothing here runs.
+ */
+
+//runs call and records it, returning what it returned
+#define TRACED(op, path, offset, size, mode, call) \
+	unsigned long long trace_started = trace_now(); \
+	__typeof__(call) trace_res = (call); \
+	trace_record(op, path, offset, size, mode, trace_res, trace_started); \
+	return trace_res
+
+#if FUSE_USE_VERSION >= 30
+static int traced_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+	TRACED(TRACE_GETATTR, path, 0, 0, 0, cs1550_getattr3(path, stbuf, fi));
+}
+
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	TRACED(TRACE_READDIR, path, offset, 0, (flags & FUSE_READDIR_PLUS) != 0,
+			cs1550_readdir3(path, buf, filler, offset, fi, flags));
+}
+
+static int traced_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	TRACED(TRACE_TRUNCATE, path, 0, size, 0, cs1550_truncate3(path, size, fi));
+}
+
+static void *traced_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	trace_start();
+	return cs1550_init3(conn, cfg);
+}
+#else
+static int traced_getattr(const char *path, struct stat *stbuf)
+{
+	TRACED(TRACE_GETATTR, path, 0, 0, 0, cs1550_getattr(path, stbuf));
+}
+
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	TRACED(TRACE_READDIR, path, offset, 0, 0, cs1550_readdir(path, buf, filler, offset, fi));
+}
+
+static int traced_truncate(const char *path, off_t size)
+{
+	TRACED(TRACE_TRUNCATE, path, 0, size, 0, cs1550_truncate(path, size));
+}
+
+static void *traced_init(struct fuse_conn_info *conn)
+{
+	trace_start();
+	return cs1550_init(conn);
+}
+#endif
+
+static void traced_destroy(void *private_data)
+{
+	cs1550_destroy(private_data);
+	trace_finish();
+}
+
+static int traced_mkdir(const char *path, mode_t mode)
+{
+	TRACED(TRACE_MKDIR, path, 0, 0, mode, cs1550_mkdir(path, mode));
+}
+
+static int traced_rmdir(const char *path)
+{
+	TRACED(TRACE_RMDIR, path, 0, 0, 0, cs1550_rmdir(path));
+}
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	TRACED(TRACE_READ, path, offset, size, 0, cs1550_read(path, buf, size, offset, fi));
+}
+
+static int traced_write(const char *path, const char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	TRACED(TRACE_WRITE, path, offset, size, 0, cs1550_write(path, buf, size, offset, fi));
+}
+
+static int traced_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	TRACED(TRACE_MKNOD, path, 0, 0, mode, cs1550_mknod(path, mode, dev));
+}
+
+static int traced_unlink(const char *path)
+{
+	TRACED(TRACE_UNLINK, path, 0, 0, 0, cs1550_unlink(path));
+}
+
+static int traced_flush(const char *path, struct fuse_file_info *fi)
+{
+	TRACED(TRACE_FLUSH, path, 0, 0, 0, cs1550_flush(path, fi));
+}
+
+static int traced_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	TRACED(TRACE_FSYNC, path, 0, 0, datasync, cs1550_fsync(path, datasync, fi));
+}
+
+static int traced_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	TRACED(TRACE_FSYNCDIR, path, 0, 0, datasync, cs1550_fsyncdir(path, datasync, fi));
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi)
+{
+	TRACED(TRACE_OPEN, path, 0, 0, 0, cs1550_open(path, fi));
+}
+
+static int traced_statfs(const char *path, struct statvfs *stbuf)
+{
+	TRACED(TRACE_STATFS, path, 0, 0, 0, cs1550_statfs(path, stbuf));
+}
+
+#if FUSE_USE_VERSION >= 28
+static int traced_ioctl(const char *path, ioctl_cmd_t cmd, void *arg,
+			 struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	TRACED(TRACE_IOCTL, path, 0, 0, cmd, cs1550_ioctl(path, cmd, arg, fi, flags, data));
+}
+#endif
+
+#ifdef CS1550_LSEEK
+static off_t traced_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
+{
+	TRACED(TRACE_LSEEK, path, off, 0, whence, cs1550_lseek(path, off, whence, fi));
+}
+#endif
+
+/*
+ * points every operation at its traced wrapper
+ */
+static void trace_operations(struct fuse_operations *oper) {
+	oper->getattr = traced_getattr;
+	oper->readdir = traced_readdir;
+	oper->truncate = traced_truncate;
+	oper->init = traced_init;
+	oper->destroy = traced_destroy;
+	oper->mkdir = traced_mkdir;
+	oper->rmdir = traced_rmdir;
+	oper->read = traced_read;
+	oper->write = traced_write;
+	oper->mknod = traced_mknod;
+	oper->unlink = traced_unlink;
+	oper->flush = traced_flush;
+	oper->fsync = traced_fsync;
+	oper->fsyncdir = traced_fsyncdir;
+	oper->open = traced_open;
+	oper->statfs = traced_statfs;
+#if FUSE_USE_VERSION >= 28
+	oper->ioctl = traced_ioctl;
+#endif
+#ifdef CS1550_LSEEK
+	oper->lseek = traced_lseek;
+#endif
+}
+
+#else
+
+/******************************************************************************
+ *
+ *  LOW-LEVEL (INODE) API
+ *
+ *  Built with -DCS1550_LOWLEVEL. The kernel looks each name up once and from
+ *  then on addresses files and directories by inode number, so nothing
+ *  below ever parses a path.
  *
+ *****************************************************************************/
+
+//How long the kernel may cache names and attributes. Every change goes
+//through here, so nothing goes stale behind its back.
+#define LL_TIMEOUT 1.0
+
+//How many chains the inode table hashes into
+#define NODE_BUCKETS 1024
+
+/*
+ * An inode the kernel holds lookups on. A file's size and mode live in its
+ * directory entry, so the entry and the directory holding it are kept here
+ * until the kernel forgets the inode.
  */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
-			  struct fuse_file_info *fi)
+struct cs1550_node
+{
+	fuse_ino_t ino;
+	uint64_t nlookup;	//lookups the kernel hasn't forgotten yet
+	long parent;		//first block of the directory holding entry, 0 once unlinked
+	cs1550_file_directory entry;
+	struct cs1550_node *next;
+};
+
+static struct cs1550_node *nodes[NODE_BUCKETS];
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//The session, so init can give up on an image it can't use
+static struct fuse_session *ll_session;
+
+/*
+ * finds where ino is (or would go) in the inode table
+ * caller holds node_lock
+ */
+static struct cs1550_node **node_slot(fuse_ino_t ino) {
+	struct cs1550_node **slot = &nodes[ino % NODE_BUCKETS];
+
+	while(*slot != NULL && (*slot)->ino != ino) {
+		slot = &(*slot)->next;
+	}
+	return slot;
+}
+
+/*
+ * copies out the entry for ino and the directory holding it (0 for the root
+ * and for unlinked inodes)
+ * returns 0 on success, -ESTALE if the kernel already forgot ino
+ */
+static int node_get(fuse_ino_t ino, cs1550_file_directory *entry, long *parent) {
+	struct cs1550_node *node;
+
+	if(ino == FUSE_ROOT_ID) {
+		memset(entry, 0, sizeof(cs1550_file_directory));
+		entry->mode = S_IFDIR | 0755;
+		entry->nStartBlock = root_tree;
+		*parent = 0;
+		return 0;
+	}
+
+	pthread_mutex_lock(&node_lock);
+	node = *node_slot(ino);
+	if(node != NULL) {
+		*entry = node->entry;
+		*parent = node->parent;
+	}
+	pthread_mutex_unlock(&node_lock);
+	return (node != NULL) ? 0 : -ESTALE;
+}
+
+/*
+ * copies out the entry for ino, which has to be a directory that is still
+ * linked into the tree
+ * returns 0 on success, negative errno on failure
+ */
+static int node_dir(fuse_ino_t ino, cs1550_file_directory *entry) {
+	long parent;
+	int res = node_get(ino, entry, &parent);
+
+	if(res != 0) {
+		return res;
+	}
+	if(!S_ISDIR(entry->mode)) {
+		return -ENOTDIR;
+	}
+	if(parent == 0 && ino != FUSE_ROOT_ID) {
+		return -ENOENT;
+	}
+	return 0;
+}
+
+/*
+ * records one more kernel lookup of entry, found in parent
+ * returns 0 on success, -ENOMEM if the table can't grow
+ */
+static int node_ref(long parent, const cs1550_file_directory *entry) {
+	fuse_ino_t ino = block_ino(entry->nStartBlock);
+	struct cs1550_node **slot;
+
+	pthread_mutex_lock(&node_lock);
+	slot = node_slot(ino);
+	if(*slot == NULL) {
+		*slot = (struct cs1550_node *) calloc(1, sizeof(struct cs1550_node));
+		if(*slot == NULL) {
+			pthread_mutex_unlock(&node_lock);
+			return -ENOMEM;
+		}
+		(*slot)->ino = ino;
+		(*slot)->entry = *entry;
+	}
+	//an inode already in the table keeps its entry, whose size can be
+	//newer than the directory's copy the lookup read
+	(*slot)->nlookup++;
+	(*slot)->parent = parent;
+	pthread_mutex_unlock(&node_lock);
+	return 0;
+}
+
+/*
+ * stores ino's entry again after its size changed
+ */
+static void node_set(fuse_ino_t ino, const cs1550_file_directory *entry) {
+	struct cs1550_node *node;
+
+	pthread_mutex_lock(&node_lock);
+	node = *node_slot(ino);
+	if(node != NULL) {
+		node->entry = *entry;
+	}
+	pthread_mutex_unlock(&node_lock);
+}
+
+/*
+ * notes that ino is no longer in any directory
+ * returns 1 if the kernel still holds it, in which case its blocks wait for
+ * its last forget, 0 if not
+ */
+static int node_unlink(fuse_ino_t ino) {
+	struct cs1550_node *node;
+
+	pthread_mutex_lock(&node_lock);
+	node = *node_slot(ino);
+	if(node != NULL) {
+		node->parent = 0;
+	}
+	pthread_mutex_unlock(&node_lock);
+	return node != NULL;
+}
+
+/*
+ * drops nlookup of the kernel's lookups of ino; once none are left it
+ * leaves the table, and an unlinked file or directory goes to the reclaimer
+ */
+static void node_forget(fuse_ino_t ino, uint64_t nlookup) {
+	struct cs1550_node **slot;
+	struct cs1550_node *node;
+	long orphan = 0;
+
+	pthread_mutex_lock(&node_lock);
+	slot = node_slot(ino);
+	node = *slot;
+	if(node != NULL) {
+		if(node->nlookup > nlookup) {
+			node->nlookup -= nlookup;
+		}
+		else {
+			*slot = node->next;
+			if(node->parent == 0) {
+				orphan = node->entry.nStartBlock;
+			}
+			free(node);
+		}
+	}
+	pthread_mutex_unlock(&node_lock);
+
+	if(orphan != 0) {
+		add_orphan(orphan);
+	}
+}
+
+/*
+ * answers a lookup, mknod or mkdir with entry, which the caller has already
+ * counted with node_ref
+ */
+static void reply_entry(fuse_req_t req, const cs1550_file_directory *entry) {
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(struct fuse_entry_param));
+	e.ino = block_ino(entry->nStartBlock);
+	e.attr_timeout = LL_TIMEOUT;
+	e.entry_timeout = LL_TIMEOUT;
+	fill_stat(entry, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+/*
+ * Called once the filesystem is mounted. Sets up the image like the path
+ * API does, and lets reads be spliced when the kernel supports it.
+ */
+static void cs1550_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	if(conn->capable & FUSE_CAP_SPLICE_WRITE) {
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	}
+	if(mount_image() == -1) {
+		fprintf(stderr, ".disk is not a blank or cs1550 formatted image\n");
+		fuse_session_exit(ll_session);
+	}
+}
+
+/*
+ * Called at unmount. Files and directories that were removed while the
+ * kernel still held them haven't been forgotten yet, so they are queued
+ * before the last orphans are freed.
+ */
+static void cs1550_ll_destroy(void *userdata)
+{
+	(void) userdata;
+	struct cs1550_node *node;
+	int i;
+
+	pthread_mutex_lock(&node_lock);
+	for(i = 0; i < NODE_BUCKETS; i++) {
+		while(nodes[i] != NULL) {
+			node = nodes[i];
+			nodes[i] = node->next;
+			if(node->parent == 0) {
+				add_orphan(node->entry.nStartBlock);
+			}
+			free(node);
+		}
+	}
+	pthread_mutex_unlock(&node_lock);
+
+	unmount_image();
+}
+
+/*
+ * Looks name up in the directory parent. This is the only place a name is
+ * turned into an inode; the kernel keeps the answer until it forgets it.
+ */
+static void cs1550_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	cs1550_file_directory dir;
+	cs1550_file_directory entry;
+
+	int res = node_dir(parent, &dir);
+	if(res == 0 && strlen(name) > MAX_NAME) {
+		res = -ENAMETOOLONG;
+	}
+	if(res == 0) {
+		res = dir_lookup(dir.nStartBlock, name, &entry);
+	}
+	if(res == 0) {
+		res = node_ref(dir.nStartBlock, &entry);
+	}
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	reply_entry(req, &entry);
+}
+
+static void cs1550_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	node_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+/*
+ * The kernel batches forgets when it drops many inodes at once, e.g. after
+ * a large rm -r, so this takes one request for all of them.
+ */
+static void cs1550_ll_forget_multi(fuse_req_t req, size_t count,
+			 struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	for(i = 0; i < count; i++) {
+		node_forget(forgets[i].ino, forgets[i].nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+static void cs1550_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	cs1550_file_directory entry;
+	struct stat st;
+	long dir;
+
+	int res = node_get(ino, &entry, &dir);
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fill_stat(&entry, &st);
+	fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+/*
+ * Only the size can be changed (truncate); nothing else is stored, so any
+ * other attribute is left as it is.
+ */
+static void cs1550_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			 int to_set, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	cs1550_file_directory entry;
+	struct stat st;
+	long dir;
+
+	int res = node_get(ino, &entry, &dir);
+	if(res == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+		if(S_ISDIR(entry.mode)) {
+			res = -EISDIR;
+		}
+		else {
+			//see cs1550_ll_write
+			pthread_rwlock_t *lock = file_lock(entry.nStartBlock);
+			pthread_rwlock_wrlock(lock);
+			res = node_get(ino, &entry, &dir);
+			if(res == 0) {
+				res = truncate_blocks(dir, &entry, attr->st_size);
+				node_set(ino, &entry);
+			}
+			pthread_rwlock_unlock(lock);
+		}
+	}
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fill_stat(&entry, &st);
+	fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+//where cs1550_ll_readdir's and cs1550_ll_readdirplus's entries go
+struct cs1550_ll_dirbuf
+{
+	fuse_req_t req;
+	char *buf;
+	size_t size;
+	size_t used;
+	long dir;	//start block of the directory being listed
+	int err;
+};
+
+/*
+ * adds one entry to the reply buffer
+ * returns nonzero once it doesn't fit anymore
+ */
+static int add_dir_entry(void *ctx, const char *name,
+			 const cs1550_file_directory *entry, off_t next) {
+	struct cs1550_ll_dirbuf *db = (struct cs1550_ll_dirbuf *) ctx;
+	struct stat st;
+
+	if(entry == NULL) {
+		memset(&st, 0, sizeof(struct stat));
+		st.st_mode = S_IFDIR;
+	}
+	else {
+		fill_stat(entry, &st);
+	}
+	size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used,
+			name, &st, next);
+	if(len > db->size - db->used) {
+		return 1;
+	}
+	db->used += len;
+	return 0;
+}
+
+/*
+ * adds one entry and its attributes to the reply buffer; every entry but
+ * "." and ".." counts as a lookup the kernel will forget later
+ * returns nonzero once it doesn't fit anymore
+ */
+static int add_dir_entry_plus(void *ctx, const char *name,
+			 const cs1550_file_directory *entry, off_t next) {
+	struct cs1550_ll_dirbuf *db = (struct cs1550_ll_dirbuf *) ctx;
+	struct fuse_entry_param e;
+
+	memset(&e, 0, sizeof(struct fuse_entry_param));
+	if(entry == NULL) {
+		e.attr.st_mode = S_IFDIR;
+	}
+	else {
+		fill_stat(entry, &e.attr);
+	}
+	//the kernel doesn't look up "." and "..", so they get no inode here
+	if(strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+		e.ino = block_ino(entry->nStartBlock);
+		e.attr_timeout = LL_TIMEOUT;
+		e.entry_timeout = LL_TIMEOUT;
+	}
+	size_t len = fuse_add_direntry_plus(db->req, db->buf + db->used, db->size - db->used,
+			name, &e, next);
+	if(len > db->size - db->used) {
+		return 1;
+	}
+	//only entries that made it into the reply are referenced
+	if(e.ino != 0) {
+		db->err = node_ref(db->dir, entry);
+		if(db->err != 0) {
+			return 1;
+		}
+	}
+	db->used += len;
+	return 0;
+}
+
+/*
+ * Fills one reply buffer with entries after off, resuming the same way the
+ * path API's readdir does.
+ */
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t off, dir_emit_t emit)
+{
+	struct cs1550_ll_dirbuf db;
+	cs1550_file_directory dir;
+
+	int res = node_dir(ino, &dir);
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	db.req = req;
+	db.buf = (char *) malloc(size);
+	db.size = size;
+	db.used = 0;
+	db.dir = dir.nStartBlock;
+	db.err = 0;
+	if(db.buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	res = dir_stream(&dir, off, emit, &db);
+	//an empty reply would read as the end of the directory
+	if(res == 0 && db.used == 0) {
+		res = db.err;
+	}
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+	}
+	else {
+		fuse_reply_buf(req, db.buf, db.used);
+	}
+	free(db.buf);
+}
+
+static void cs1550_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t off, struct fuse_file_info *fi)
+{
+	(void) fi;
+	ll_readdir(req, ino, size, off, add_dir_entry);
+}
+
+/*
+ * Same as readdir, but hands the kernel each entry's attributes too so an
+ * ls -l doesn't need a lookup per name.
+ */
+static void cs1550_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t off, struct fuse_file_info *fi)
+{
+	(void) fi;
+	ll_readdir(req, ino, size, off, add_dir_entry_plus);
+}
+
+/*
+ * creates name in the directory parent and hands the new inode back
+ */
+static void create_entry(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	cs1550_file_directory dir;
+	cs1550_file_directory entry;
+
+	int res = node_dir(parent, &dir);
+	if(res == 0 && strlen(name) > MAX_NAME) {
+		res = -ENAMETOOLONG;
+	}
+	if(res == 0) {
+		memset(&entry, 0, sizeof(cs1550_file_directory));
+		strcpy(entry.name, name);
+		entry.mode = mode;
+		res = dir_create(dir.nStartBlock, &entry);
+	}
+	if(res == 0) {
+		res = node_ref(dir.nStartBlock, &entry);
+	}
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	reply_entry(req, &entry);
+}
+
+/*
+ * Creates a directory. Mode is ignored just like in the path API.
+ */
+static void cs1550_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	(void) mode;
+	create_entry(req, parent, name, S_IFDIR | 0755);
+}
+
+/*
+ * Creates a regular file. Mode and rdev are ignored just like in the path API.
+ */
+static void cs1550_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode, dev_t rdev)
+{
+	(void) mode;
+	(void) rdev;
+	create_entry(req, parent, name, S_IFREG | 0666);
+}
+
+/*
+ * Takes a file out of its directory. Its blocks go to the reclaimer right
+ * away unless the kernel still holds the inode (it is open, say), in which
+ * case they wait for the last forget.
+ */
+static void cs1550_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	cs1550_file_directory dir;
+	cs1550_file_directory entry;
+
+	int res = node_dir(parent, &dir);
+	if(res == 0) {
+		res = dir_lookup(dir.nStartBlock, name, &entry);
+	}
+	if(res == 0 && S_ISDIR(entry.mode)) {
+		res = -EISDIR;
+	}
+	if(res == 0) {
+		res = dir_remove(dir.nStartBlock, name, &entry);
+	}
+	if(res == 0 && !node_unlink(block_ino(entry.nStartBlock))) {
+		add_orphan(entry.nStartBlock);
+	}
+	fuse_reply_err(req, -res);
+}
+
+/*
+ * Removes an empty directory. Like an unlinked file, its blocks wait on the
+ * orphan list until the kernel forgets it, so its inode number can't be
+ * handed to something new while the kernel still uses it. The kernel can't
+ * list or create anything in it meanwhile since it is marked unlinked.
+ */
+static void cs1550_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	cs1550_file_directory dir;
+	cs1550_file_directory entry;
+
+	int res = node_dir(parent, &dir);
+	if(res == 0) {
+		res = dir_lookup(dir.nStartBlock, name, &entry);
+	}
+	if(res == 0 && !S_ISDIR(entry.mode)) {
+		res = -ENOTDIR;
+	}
+	if(res == 0) {
+		res = dir_rmdir(dir.nStartBlock, &entry, 0);
+	}
+	if(res == 0 && !node_unlink(block_ino(entry.nStartBlock))) {
+		add_orphan(entry.nStartBlock);
+	}
+	fuse_reply_err(req, -res);
+}
+
+/*
+ * Reads are answered with a buffer vector pointing into the images (and at a
+ * block of zeros for holes) instead of a copy, so with splice the data goes
+ * from the image to the kernel without passing through here. With -o ram
+ * it points straight into memory.
+ */
+static void cs1550_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t off, struct fuse_file_info *fi)
 {
-	(void) buf;
-	(void) offset;
 	(void) fi;
-	(void) path;
 
-	int f_size;
-	int d_block = -1;
-
-	cs1550_directory_entry cur_directory;
+	static char zeros[MAX_DATA_IN_BLOCK];
+	cs1550_file_directory entry;
 	cs1550_inode inode;
-	cs1550_disk_block cur_disk_block;
-	char directory[MAX_FILENAME+1];
-	char filename[MAX_FILENAME+1];
-	char extension[MAX_EXTENSION+1];
-
-	//initialize directories to null character
-	directory[0] = '\0';
-	filename[0] = '\0';
-	extension[0] = '\0';
-
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-
-	//read in data
-	int directory_index = find_directory(directory);
-	get_directory(&cur_directory, directory_index);
-	int index = find_file(&cur_directory, filename, extension);
-	f_size = cur_directory.files[index].fsize;
-
-	//check that offset is <= to the file size
-	if(offset > f_size) {
-		//printf("Too big, return\n");
-		return -EFBIG;
+	long dir;
+
+	int res = node_get(ino, &entry, &dir);
+	if(res == 0 && S_ISDIR(entry.mode)) {
+		res = -EISDIR;
 	}
-	//check that size is > 0
-	if(f_size < 0) {
-		return -ENOENT;
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+		return;
 	}
-	//check if path is a directory
-	if(strcmp(filename, "\0") == 0) {
-		return -EISDIR;
+
+	//nothing to read at or past the end of the file
+	off_t f_size = entry.fsize;
+	if(off >= f_size || size == 0) {
+		fuse_reply_buf(req, NULL, 0);
+		return;
+	}
+	if((off_t) size > f_size - off) {
+		size = f_size - off;
 	}
 
-	//get inode for file
-	int inode_start = cur_directory.files[index].nStartBlock;
-	//read in inode from disk
-	FILE *f = fopen(".disk", "rb+");
-	fseek(f, inode_start, SEEK_SET);
-	fread(&inode, sizeof(cs1550_inode), 1, f);
-	fclose(f); 
+	size_t count = (off + size - 1) / MAX_DATA_IN_BLOCK - off / MAX_DATA_IN_BLOCK + 1;
+	struct fuse_bufvec *bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec) +
+			(count - 1) * sizeof(struct fuse_buf));
+	if(bufv == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	//the reply reads the blocks straight from the images, so the
+	//defragmenter has to leave them where they are until it is sent
+	pthread_rwlock_t *lock = file_lock(entry.nStartBlock);
+	pthread_rwlock_rdlock(lock);
+	get_inode(&inode, entry.nStartBlock);
 
-	int i;
-	int block_index = 0;
-	if(inode.children > 0) {
-		block_index = offset / (MAX_DATA_IN_BLOCK);
-		d_block = ((long)inode.pointers[block_index]) / BLOCK_SIZE;
-		get_disk_block(&cur_disk_block, d_block * BLOCK_SIZE);
-	}	
+	memset(bufv, 0, sizeof(struct fuse_bufvec) + (count - 1) * sizeof(struct fuse_buf));
+	bufv->count = count;
+	size_t bytes_read = 0;
+	size_t i;
+	for(i = 0; i < count; i++) {
+		unsigned int block_index = (off + bytes_read) / MAX_DATA_IN_BLOCK;
+		size_t block_offset = (off + bytes_read) % MAX_DATA_IN_BLOCK;
+		size_t chunk = MAX_DATA_IN_BLOCK - block_offset;
+		if(chunk > size - bytes_read) {
+			chunk = size - bytes_read;
+		}
+
+		bufv->buf[i].size = chunk;
+		if(block_index >= inode.children || inode.pointers[block_index] == 0) {
+			bufv->buf[i].mem = zeros;
+		}
+		else if(members[0].ram != NULL) {
+			bufv->buf[i].mem = members[data_member(inode.pointers[block_index])].ram +
+					inode.pointers[block_index] + offsetof(cs1550_disk_block, data) + block_offset;
+		}
+		else {
+			//straight from whichever image the block is striped onto
+			bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			bufv->buf[i].fd = members[data_member(inode.pointers[block_index])].fd;
+			bufv->buf[i].pos = inode.pointers[block_index] +
+					offsetof(cs1550_disk_block, data) + block_offset;
+		}
+		bytes_read += chunk;
+	}
 
-	int read_start = offset % (MAX_DATA_IN_BLOCK-1);
-	int bytes_read = 0;
+	fuse_reply_data(req, bufv, 0);
+	pthread_rwlock_unlock(lock);
+	free(bufv);
+}
 
-	strcpy(buf, &cur_disk_block.data[read_start]);
-	bytes_read += (MAX_DATA_IN_BLOCK-read_start);
+static void cs1550_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			 size_t size, off_t off, struct fuse_file_info *fi)
+{
+	(void) fi;
 
-	int numReads = (size + offset + MAX_DATA_IN_BLOCK-1) / (MAX_DATA_IN_BLOCK); 
+	cs1550_file_directory entry;
+	long dir;
 
-	int start = block_index + 1;
-	
-	for(i = start; i < numReads && i < inode.children; i++) {
-		d_block = ((long)inode.pointers[i]) / BLOCK_SIZE;
-		get_disk_block(&cur_disk_block, d_block * BLOCK_SIZE);
-		strcat(buf, cur_disk_block.data);
+	int res = node_get(ino, &entry, &dir);
+	if(res == 0 && S_ISDIR(entry.mode)) {
+		res = -EISDIR;
 	}
+	if(res == 0) {
+		//the size comes from the table and goes back into it under the
+		//file's lock, so two writes can't store each other's stale size
+		pthread_rwlock_t *lock = file_lock(entry.nStartBlock);
+		pthread_rwlock_wrlock(lock);
+		res = node_get(ino, &entry, &dir);
+		if(res == 0) {
+			res = write_blocks(dir, &entry, buf, size, off);
+			node_set(ino, &entry);
+		}
+		pthread_rwlock_unlock(lock);
+	}
+	if(res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_write(req, res);
+}
 
-	//set size and return
-	return size;
+/*
+ * fsync and fsyncdir, see cs1550_fsync
+ */
+static void cs1550_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			 struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	cs1550_file_directory entry;
+	long dir;
+
+	int res = node_get(ino, &entry, &dir);
+	if(res == 0 && S_ISDIR(entry.mode)) {
+		res = sync_image(NULL, 0, 1);
+	}
+	else if(res == 0) {
+		res = sync_file(entry.nStartBlock, datasync);
+	}
+	fuse_reply_err(req, -res);
 }
 
-/* 
- * Write size bytes from buf into file starting from offset
- *
+/*
+ * statfs, see cs1550_statfs
  */
-static int cs1550_write(const char *path, const char *buf, size_t size, 
-			  off_t offset, struct fuse_file_info *fi)
+static void cs1550_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	(void) ino;
+
+	struct statvfs stbuf;
+	fill_statfs(&stbuf);
+	fuse_reply_statfs(req, &stbuf);
+}
+
+/*
+ * ioctl, see cs1550_ioctl
+ */
+static void cs1550_ll_ioctl(fuse_req_t req, fuse_ino_t ino, ioctl_cmd_t cmd, void *arg,
+			 struct fuse_file_info *fi, unsigned flags, const void *in_buf,
+			 size_t in_bufsz, size_t out_bufsz)
 {
-	(void) buf;
-	(void) offset;
+	(void) ino;
+	(void) arg;
 	(void) fi;
-	(void) path;
+	(void) in_buf;
+	(void) in_bufsz;
 
-	int f_size;
-	int result;
-	int d_block = -1;
+	struct cs1550_defrag_status status;
 
-	cs1550_directory_entry cur_directory;
-	cs1550_inode inode;
-	cs1550_disk_block cur_disk_block;
-	char directory[MAX_FILENAME+1];
-	char filename[MAX_FILENAME+1];
-	char extension[MAX_EXTENSION+1];
-
-	//initialize directories to null character
-	directory[0] = '\0';
-	filename[0] = '\0';
-	extension[0] = '\0';
-
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-	
-	int directory_index = find_directory(directory);
-	get_directory(&cur_directory, directory_index);
-	int index = find_file(&cur_directory, filename, extension);
-	//check to make sure path exists
-	if(index == -1) {
-		return -ENOENT;
+	if(flags & FUSE_IOCTL_COMPAT) {
+		fuse_reply_err(req, ENOSYS);
+		return;
 	}
-	f_size = cur_directory.files[index].fsize;
-	//check that offset is <= to the file size
-	if(offset > f_size) {
-		result = -EFBIG;
-		offset = f_size;
+	if((unsigned int) cmd == CS1550_IOC_DEFRAG_STATUS && out_bufsz < sizeof(status)) {
+		fuse_reply_err(req, EINVAL);
+		return;
 	}
-	else {
-		result = size;
+	int res = defrag_ioctl(cmd, &status);
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+		return;
 	}
-	//get inode for file
-	int inode_start = cur_directory.files[index].nStartBlock;
-	//read in inode from disk
-	FILE *f = fopen(".disk", "rb+");
-	fseek(f, inode_start, SEEK_SET);
-	fread(&inode, sizeof(cs1550_inode), 1, f); 
-
-	//equivalent to ceil((size+offset)/(MAX_DATA_IN_BLOCK-1))
-	int blocks_needed = (size + offset + MAX_DATA_IN_BLOCK-2) / (MAX_DATA_IN_BLOCK-1);
-
-	//check if inode contains children
-	printf("Blocks needed: %d\n", blocks_needed);
-	while(blocks_needed > inode.children) {
-		cur_disk_block.magic_number = 0xF113DA7A;
-		d_block = allocate_block();
-		update_bitmap("allocate", d_block);
-		inode.pointers[inode.children] = (unsigned long) d_block * BLOCK_SIZE;
-		inode.children = inode.children + 1;
-
-		//write new disk block
-		fseek(f, d_block * BLOCK_SIZE, SEEK_SET);
-		fwrite(&cur_disk_block, sizeof(cs1550_disk_block), 1, f);
-		rewind(f);
+	if((unsigned int) cmd == CS1550_IOC_DEFRAG_STATUS) {
+		fuse_reply_ioctl(req, 0, &status, sizeof(status));
 	}
+	else {
+		fuse_reply_ioctl(req, 0, NULL, 0);
+	}
+}
 
-	//get disk block and write first block
-	int block_index = offset / (MAX_DATA_IN_BLOCK-1);
-	d_block = ((long)inode.pointers[block_index]) / BLOCK_SIZE;
-	get_disk_block(&cur_disk_block, d_block * BLOCK_SIZE);
+#ifdef CS1550_LSEEK
+static void cs1550_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+			 struct fuse_file_info *fi)
+{
+	(void) fi;
 
-	int start_point = offset % MAX_DATA_IN_BLOCK;
-	strncpy(&cur_disk_block.data[start_point], buf, MAX_DATA_IN_BLOCK-start_point-1);	
-	buf+=(MAX_DATA_IN_BLOCK-1);
+	cs1550_file_directory entry;
+	long dir;
+	off_t found;
 
-	fseek(f, d_block * BLOCK_SIZE, SEEK_SET);
-	fwrite(&cur_disk_block, sizeof(cs1550_disk_block), 1, f);
-	rewind(f);
+	int res = node_get(ino, &entry, &dir);
+	if(res == 0 && S_ISDIR(entry.mode)) {
+		res = -EISDIR;
+	}
+	found = (res == 0) ? file_lseek(&entry, off, whence) : res;
+	if(found < 0) {
+		fuse_reply_err(req, -found);
+		return;
+	}
+	fuse_reply_lseek(req, found);
+}
+#endif
 
-	int start = block_index + 1;
-	int i;
-	//write the rest of the blocks
-	for(i = start; i < blocks_needed; i++) {
-		d_block = ((long)inode.pointers[i]) / BLOCK_SIZE;
-		get_disk_block(&cur_disk_block, d_block * BLOCK_SIZE);
-		strncpy(cur_disk_block.data, buf, MAX_DATA_IN_BLOCK-1);
+static struct fuse_lowlevel_ops hello_ll_oper = {
+	.init	= cs1550_ll_init,
+	.destroy	= cs1550_ll_destroy,
+	.lookup	= cs1550_ll_lookup,
+	.forget	= cs1550_ll_forget,
+	.forget_multi	= cs1550_ll_forget_multi,
+	.getattr	= cs1550_ll_getattr,
+	.setattr	= cs1550_ll_setattr,
+	.readdir	= cs1550_ll_readdir,
+	.readdirplus	= cs1550_ll_readdirplus,
+	.mkdir	= cs1550_ll_mkdir,
+	.rmdir	= cs1550_ll_rmdir,
+	.mknod	= cs1550_ll_mknod,
+	.unlink	= cs1550_ll_unlink,
+	.read	= cs1550_ll_read,
+	.write	= cs1550_ll_write,
+	.fsync	= cs1550_ll_fsync,
+	.fsyncdir	= cs1550_ll_fsync,
+	.statfs	= cs1550_ll_statfs,
+	.ioctl	= cs1550_ll_ioctl,
+#ifdef CS1550_LSEEK
+	.lseek	= cs1550_ll_lseek,
+#endif
+};
 
-		fseek(f, d_block * BLOCK_SIZE, SEEK_SET);
-		fwrite(&cur_disk_block, sizeof(cs1550_disk_block), 1, f);
-		rewind(f);
+/*
+ * What fuse_main does for the path API: parse the command line, mount and
+ * run the session loop until unmount.
+ */
+static int ll_main(struct fuse_args *args)
+{
+	struct fuse_cmdline_opts opts;
+	int res = 1;
 
-		buf+=(MAX_DATA_IN_BLOCK-1);
+	if(fuse_parse_cmdline(args, &opts) != 0) {
+		return 1;
 	}
-	
-	//update file size
-	if(offset == 0) {
-		cur_directory.files[index].fsize = size;
+	if(opts.show_help) {
+		printf("usage: %s [options] <mountpoint>\n\n", args->argv[0]);
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		res = 0;
+	}
+	else if(opts.show_version) {
+		printf("FUSE library version %s\n", fuse_pkgversion());
+		fuse_lowlevel_version();
+		res = 0;
+	}
+	else if(opts.mountpoint == NULL) {
+		fprintf(stderr, "usage: %s [options] <mountpoint>\n", args->argv[0]);
 	}
 	else {
-		cur_directory.files[index].fsize += size;	
+		ll_session = fuse_session_new(args, &hello_ll_oper, sizeof(hello_ll_oper), NULL);
+		if(ll_session != NULL && fuse_set_signal_handlers(ll_session) == 0) {
+			if(fuse_session_mount(ll_session, opts.mountpoint) == 0) {
+				fuse_daemonize(opts.foreground);
+				if(opts.singlethread) {
+					res = fuse_session_loop(ll_session);
+				}
+				else {
+#if FUSE_USE_VERSION < 32
+					res = fuse_session_loop_mt(ll_session, opts.clone_fd);
+#else
+					struct fuse_loop_config config;
+					config.clone_fd = opts.clone_fd;
+					config.max_idle_threads = opts.max_idle_threads;
+					res = fuse_session_loop_mt(ll_session, &config);
+#endif
+				}
+				fuse_session_unmount(ll_session);
+			}
+			fuse_remove_signal_handlers(ll_session);
+		}
+		if(ll_session != NULL) {
+			fuse_session_destroy(ll_session);
+		}
 	}
-	
-	//write updated file size
-	fseek(f, directory_index, SEEK_SET);
-	fwrite(&cur_directory, sizeof(cs1550_directory_entry), 1, f);
-	rewind(f);
 
-	//write updated inode
-	fseek(f, inode_start, SEEK_SET);
-	fwrite(&inode, sizeof(cs1550_inode), 1, f);
-	rewind(f);	
-	fclose(f);
-	
-	//set size (should be same as input) and return, or error
-	return result;
+	free(opts.mountpoint);
+	return res ? 1 : 0;
 }
 
+#endif
+
+#ifdef CS1550_REPLAY
+
 /******************************************************************************
  *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
+ *  TRACE REPLAY
+ *
+ *  Built with -DCS1550_REPLAY, main replays a trace recorded with -o trace=
+ *  instead of mounting anything:
+ *
+ *	cs1550-replay [-f] -i new-image trace	calls the cs1550_* functions on a
+ *						fresh image of its own
+ *	cs1550-replay [-f] -m mountpoint trace	makes the matching system calls
+ *						under a freshly mounted filesystem
+ *
+ *  With -i, -o durability= applies as it would to a mount, and -o trace=
+ *  records the replay itself for comparison.
+ *
+ *  Calls are replayed one at a time in the order they started, so every run
+ *  does the same thing in the same order. They keep their original spacing
+ *  unless -f asks for full speed.
  *
  *****************************************************************************/
 
+//How big a buffer readdir gets to fill, as the kernel's usually is
+#define REPLAY_DIR_BUF 4096
+
+//One recorded call and its path
+struct replay_op
+{
+	cs1550_trace_record record;
+	char *path;
+	long order;		//where it was in the file, breaks ties in start time
+};
+
+//What replaying one kind of operation came to
+struct replay_stats
+{
+	long count;
+	long skipped;		//calls that have no system call of their own
+	long differ;		//calls that returned something other than in the trace
+	unsigned long long traced;	//total nanoseconds in the trace
+	unsigned long long *latency;	//nanoseconds each replayed call took
+};
+
+static const char *replay_names[TRACE_OPS] = {
+	[TRACE_GETATTR] = "getattr", [TRACE_READDIR] = "readdir", [TRACE_MKDIR] = "mkdir",
+	[TRACE_RMDIR] = "rmdir", [TRACE_MKNOD] = "mknod", [TRACE_UNLINK] = "unlink",
+	[TRACE_READ] = "read", [TRACE_WRITE] = "write", [TRACE_TRUNCATE] = "truncate",
+	[TRACE_OPEN] = "open", [TRACE_FLUSH] = "flush", [TRACE_FSYNC] = "fsync",
+	[TRACE_FSYNCDIR] = "fsyncdir", [TRACE_LSEEK] = "lseek", [TRACE_STATFS] = "statfs",
+	[TRACE_IOCTL] = "ioctl",
+};
+
+static int compare_replay_ops(const void *a, const void *b) {
+	const struct replay_op *x = (const struct replay_op *) a;
+	const struct replay_op *y = (const struct replay_op *) b;
+
+	if(x->record.start != y->record.start) {
+		return (x->record.start < y->record.start) ? -1 : 1;
+	}
+	return (x->order < y->order) ? -1 : (x->order > y->order);
+}
+
+static int compare_latency(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+	return (x < y) ? -1 : (x > y);
+}
+
 /*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or 
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
+ * reads a whole trace into memory, sorted by start time
+ * returns how many calls it holds (lost is how many the recording
+ * dropped), -1 if it can't be read
  */
-static int cs1550_truncate(const char *path, off_t size)
+static long load_trace(const char *trace, struct replay_op **ops, unsigned long long *lost) {
+	cs1550_trace_header header;
+	cs1550_trace_record record;
+	long count = 0;
+	long room = 1024;
+
+	FILE *f = fopen(trace, "rb");
+	if(f == NULL) {
+		fprintf(stderr, "%s: %s\n", trace, strerror(errno));
+		return -1;
+	}
+	if(fread(&header, sizeof(cs1550_trace_header), 1, f) != 1 || header.magic_number != TRACE_MAGIC ||
+			header.nVersion != TRACE_VERSION) {
+		fprintf(stderr, "%s is not a cs1550 trace\n", trace);
+		fclose(f);
+		return -1;
+	}
+	if(header.nBlockSize != BLOCK_SIZE) {
+		fprintf(stderr, "%s was recorded with %u byte blocks, replaying with %d\n",
+				trace, header.nBlockSize, BLOCK_SIZE);
+	}
+
+	*lost = 0;
+	*ops = (struct replay_op *) malloc(room * sizeof(struct replay_op));
+	while(*ops != NULL && fread(&record, sizeof(cs1550_trace_record), 1, f) == 1) {
+		char *path = (char *) malloc(record.pathLen + 1);
+		if(path == NULL || fread(path, 1, record.pathLen, f) != record.pathLen) {
+			free(path);
+			break;
+		}
+		path[record.pathLen] = '\0';
+		if(record.op == TRACE_DROPPED) {
+			*lost += record.size;
+			free(path);
+			continue;
+		}
+		if(record.op < TRACE_GETATTR || record.op >= TRACE_OPS) {
+			free(path);
+			continue;
+		}
+		if(count == room) {
+			room *= 2;
+			struct replay_op *more = (struct replay_op *) realloc(*ops, room * sizeof(struct replay_op));
+			if(more == NULL) {
+				free(path);
+				break;
+			}
+			*ops = more;
+		}
+		(*ops)[count].record = record;
+		(*ops)[count].path = path;
+		(*ops)[count].order = count;
+		count++;
+	}
+	fclose(f);
+	if(*ops == NULL) {
+		return -1;
+	}
+	qsort(*ops, count, sizeof(struct replay_op), compare_replay_ops);
+	return count;
+}
+
+/*
+ * readdir filler that stops once a kernel sized buffer would be full,
+ * buf being how much of it is used
+ */
+#if FUSE_USE_VERSION >= 30
+static int replay_filler(void *buf, const char *name, const struct stat *stbuf,
+			 off_t off, enum fuse_fill_dir_flags flags)
+#else
+static int replay_filler(void *buf, const char *name, const struct stat *stbuf, off_t off)
+#endif
 {
-	(void) path;
-	(void) size;
+	size_t *used = (size_t *) buf;
+	(void) stbuf;
+	(void) off;
+#if FUSE_USE_VERSION >= 30
+	(void) flags;
+#endif
+
+	//what fuse_add_direntry would take for it
+	*used += (24 + strlen(name) + 7) & ~(size_t) 7;
+	return *used > REPLAY_DIR_BUF;
+}
+
+/*
+ * makes one call straight into the filesystem, through hello_oper so that
+ * -o trace= can record the replay too
+ * returns what it returned
+ */
+static long long replay_direct(const struct replay_op *op, char *buf) {
+	const cs1550_trace_record *r = &op->record;
+	struct stat stbuf;
+	struct statvfs vfs;
+	size_t used = 0;
 
-    return 0;
+	switch(r->op) {
+#if FUSE_USE_VERSION >= 30
+	case TRACE_GETATTR:
+		return hello_oper.getattr(op->path, &stbuf, NULL);
+	case TRACE_READDIR:
+		return hello_oper.readdir(op->path, &used, replay_filler, r->offset, NULL,
+				r->mode ? FUSE_READDIR_PLUS : 0);
+	case TRACE_TRUNCATE:
+		return hello_oper.truncate(op->path, r->size, NULL);
+#else
+	case TRACE_GETATTR:
+		return hello_oper.getattr(op->path, &stbuf);
+	case TRACE_READDIR:
+		return hello_oper.readdir(op->path, &used, replay_filler, r->offset, NULL);
+	case TRACE_TRUNCATE:
+		return hello_oper.truncate(op->path, r->size);
+#endif
+	case TRACE_MKDIR:
+		return hello_oper.mkdir(op->path, r->mode);
+	case TRACE_RMDIR:
+		return hello_oper.rmdir(op->path);
+	case TRACE_MKNOD:
+		return hello_oper.mknod(op->path, r->mode, 0);
+	case TRACE_UNLINK:
+		return hello_oper.unlink(op->path);
+	case TRACE_READ:
+		return hello_oper.read(op->path, buf, r->size, r->offset, NULL);
+	case TRACE_WRITE:
+		return hello_oper.write(op->path, buf, r->size, r->offset, NULL);
+	case TRACE_OPEN:
+		return hello_oper.open(op->path, NULL);
+	case TRACE_FLUSH:
+		return hello_oper.flush(op->path, NULL);
+	case TRACE_FSYNC:
+		return hello_oper.fsync(op->path, r->mode, NULL);
+	case TRACE_FSYNCDIR:
+		return hello_oper.fsyncdir(op->path, r->mode, NULL);
+#ifdef CS1550_LSEEK
+	case TRACE_LSEEK:
+		return hello_oper.lseek(op->path, r->offset, r->mode, NULL);
+#endif
+	case TRACE_STATFS:
+		return hello_oper.statfs(op->path, &vfs);
+#if FUSE_USE_VERSION >= 28
+	case TRACE_IOCTL:
+		return hello_oper.ioctl(op->path, r->mode, NULL, NULL, 0, buf);
+#endif
+	}
+	return -ENOSYS;
 }
 
+/*
+ * opens path, runs one system call on the descriptor and closes it again
+ * returns what the call returned, negative errno on failure
+ */
+static long long replay_on_fd(const char *path, int flags, const struct replay_op *op, char *buf) {
+	const cs1550_trace_record *r = &op->record;
+	long long res = 0;
 
-/* 
- * Called when we open a file
- *
+	int fd = open(path, flags);
+	if(fd == -1) {
+		return -errno;
+	}
+	switch(r->op) {
+	case TRACE_READ:
+		res = pread(fd, buf, r->size, r->offset);
+		break;
+	case TRACE_WRITE:
+		res = pwrite(fd, buf, r->size, r->offset);
+		break;
+	case TRACE_FSYNC:
+		res = r->mode ? fdatasync(fd) : fsync(fd);
+		break;
+	case TRACE_FSYNCDIR:
+		res = fsync(fd);
+		break;
+	case TRACE_LSEEK:
+		res = lseek(fd, r->offset, r->mode);
+		break;
+	case TRACE_IOCTL:
+		res = ioctl(fd, r->mode, buf);
+		break;
+	}
+	if(res < 0) {
+		res = -errno;
+	}
+	close(fd);
+	return res;
+}
+
+/*
+ * makes the system call that produces one call under mountpoint. The
+ * kernel adds lookups of its own, and calls it makes by itself (flush,
+ * readdir past the first buffer) aren't made here at all.
+ * returns what the call returned, 1 in skipped if it was left out
  */
-static int cs1550_open(const char *path, struct fuse_file_info *fi)
-{
-	(void) path;
-	(void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
+static long long replay_mounted(const char *mountpoint, const struct replay_op *op, char *buf, int *skipped) {
+	const cs1550_trace_record *r = &op->record;
+	char path[PATH_MAX];
+	struct stat stbuf;
+	struct statvfs vfs;
+	long long res = 0;
 
-    //It's not really necessary for this project to anything in open
+	*skipped = 0;
+	snprintf(path, sizeof(path), "%s%s", mountpoint, op->path);
+	switch(r->op) {
+	case TRACE_GETATTR:
+		res = lstat(path, &stbuf);
+		break;
+	case TRACE_READDIR: {
+		if(r->offset != 0) {
+			*skipped = 1;
+			return r->result;
+		}
+		DIR *d = opendir(path);
+		if(d == NULL) {
+			return -errno;
+		}
+		while(readdir(d) != NULL) {
+		}
+		closedir(d);
+		return 0;
+	}
+	case TRACE_MKDIR:
+		res = mkdir(path, r->mode & 07777);
+		break;
+	case TRACE_RMDIR:
+		res = rmdir(path);
+		break;
+	case TRACE_MKNOD:
+		res = mknod(path, r->mode, 0);
+		break;
+	case TRACE_UNLINK:
+		res = unlink(path);
+		break;
+	case TRACE_READ:
+		return replay_on_fd(path, O_RDONLY, op, buf);
+	case TRACE_WRITE:
+		return replay_on_fd(path, O_WRONLY, op, buf);
+	case TRACE_TRUNCATE:
+		res = truncate(path, r->size);
+		break;
+	case TRACE_OPEN:
+		res = open(path, O_RDONLY);
+		if(res >= 0) {
+			close(res);
+			res = 0;
+		}
+		break;
+	case TRACE_FLUSH:
+		*skipped = 1;
+		return r->result;
+	case TRACE_FSYNC:
+		return replay_on_fd(path, O_RDONLY, op, buf);
+	case TRACE_FSYNCDIR:
+		return replay_on_fd(path, O_RDONLY | O_DIRECTORY, op, buf);
+	case TRACE_LSEEK:
+		return replay_on_fd(path, O_RDONLY, op, buf);
+	case TRACE_STATFS:
+		res = statvfs(path, &vfs);
+		break;
+	case TRACE_IOCTL:
+		return replay_on_fd(path, O_RDONLY, op, buf);
+	}
+	return (res < 0) ? -errno : res;
+}
 
-    /* We're not going to worry about permissions for this project, but 
-	   if we were and we don't have them to the file we should return an error
+/*
+ * creates a new, blank image of DISK_SIZE bytes, refusing to touch one
+ * that is already there
+ * returns 0 on success, -1 on failure
+ */
+static int replay_image(const char *image) {
+	int fd = open(image, O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if(fd == -1 || ftruncate(fd, DISK_SIZE) != 0) {
+		fprintf(stderr, "%s: %s\n", image, strerror(errno));
+		if(fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
 
-        return -EACCES;
-    */
+/*
+ * prints a table of how long every kind of call took
+ */
+static void replay_report(struct replay_stats *stats, unsigned long long elapsed,
+			 unsigned long long span, unsigned long long lost) {
+	int op;
 
-    return 0; //success!
+	printf("%-10s %8s %8s %8s %10s %10s %10s %10s %10s\n", "op", "calls", "skipped",
+			"differ", "mean us", "p50 us", "p99 us", "max us", "traced us");
+	for(op = TRACE_GETATTR; op < TRACE_OPS; op++) {
+		struct replay_stats *s = &stats[op];
+		long timed = s->count - s->skipped;
+		if(s->count == 0) {
+			continue;
+		}
+		double mean = 0, p50 = 0, p99 = 0, max = 0;
+		if(timed > 0) {
+			unsigned long long total = 0;
+			long i;
+			qsort(s->latency, timed, sizeof(unsigned long long), compare_latency);
+			for(i = 0; i < timed; i++) {
+				total += s->latency[i];
+			}
+			mean = total / 1000.0 / timed;
+			p50 = s->latency[(timed - 1) / 2] / 1000.0;
+			p99 = s->latency[(timed - 1) * 99 / 100] / 1000.0;
+			max = s->latency[timed - 1] / 1000.0;
+		}
+		printf("%-10s %8ld %8ld %8ld %10.1f %10.1f %10.1f %10.1f %10.1f\n", replay_names[op],
+				s->count, s->skipped, s->differ, mean, p50, p99, max, s->traced / 1000.0 / s->count);
+	}
+	printf("replayed in %.3f s, traced over %.3f s\n", elapsed / 1e9, span / 1e9);
+	if(lost > 0) {
+		printf("the trace lost %llu calls to full rings\n", lost);
+	}
 }
 
 /*
- * Called when close is called on a file descriptor, but because it might
- * have been dup'ed, this isn't a guarantee we won't ever need the file 
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
+ * replays every call in order, as a direct call when mountpoint is NULL
+ * and as a system call under it otherwise, and reports how long they took
+ * returns 0 on success, -1 if there is no memory to do it in
  */
-static int cs1550_flush (const char *path , struct fuse_file_info *fi)
-{
-	(void) path;
-	(void) fi;
+static int replay_run(const struct replay_op *ops, long count, const char *mountpoint,
+			 int fast, unsigned long long lost) {
+	struct replay_stats stats[TRACE_OPS];
+	//big enough for any ioctl's reply too
+	size_t biggest = sizeof(struct cs1550_defrag_status);
+	int res = 0;
+	int op;
+	long i;
 
-	return 0; //success!
+	memset(stats, 0, sizeof(stats));
+	for(i = 0; i < count; i++) {
+		stats[ops[i].record.op].count++;
+		if((ops[i].record.op == TRACE_READ || ops[i].record.op == TRACE_WRITE) &&
+				ops[i].record.size > biggest) {
+			biggest = ops[i].record.size;
+		}
+	}
+	for(op = 0; op < TRACE_OPS; op++) {
+		stats[op].latency = (unsigned long long *) malloc((stats[op].count + 1) * sizeof(unsigned long long));
+		stats[op].count = 0;
+		if(stats[op].latency == NULL) {
+			res = -1;
+		}
+	}
+	//what gets written doesn't matter, only how much
+	char *buf = (char *) malloc(biggest);
+	if(buf == NULL) {
+		res = -1;
+	}
+
+	unsigned long long begin = trace_now();
+	for(i = 0; i < count && res == 0; i++) {
+		const cs1550_trace_record *r = &ops[i].record;
+		struct replay_stats *s = &stats[r->op];
+		int skipped = 0;
+		long long result;
+
+		//keep the trace's pace unless asked not to
+		if(!fast) {
+			unsigned long long due = begin + r->start;
+			unsigned long long now = trace_now();
+			if(due > now) {
+				struct timespec wait;
+				wait.tv_sec = (due - now) / 1000000000ULL;
+				wait.tv_nsec = (due - now) % 1000000000ULL;
+				nanosleep(&wait, NULL);
+			}
+		}
+
+		unsigned long long start = trace_now();
+		if(mountpoint == NULL) {
+			result = replay_direct(&ops[i], buf);
+		}
+		else {
+			result = replay_mounted(mountpoint, &ops[i], buf, &skipped);
+		}
+		unsigned long long took = trace_now() - start;
+
+		s->count++;
+		s->traced += r->duration;
+		if(skipped) {
+			s->skipped++;
+		}
+		else {
+			s->latency[s->count - s->skipped - 1] = took;
+		}
+		if(result != r->result) {
+			s->differ++;
+		}
+	}
+	unsigned long long elapsed = trace_now() - begin;
+
+	if(res == 0) {
+		replay_report(stats, elapsed, (count > 0) ? ops[count - 1].record.start : 0, lost);
+	}
+	for(op = 0; op < TRACE_OPS; op++) {
+		free(stats[op].latency);
+	}
+	free(buf);
+	return res;
 }
 
+/*
+ * main for the replay build
+ */
+static int replay_main(int argc, char *argv[]) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	const char *image = NULL;
+	const char *mountpoint = NULL;
+	struct replay_op *ops;
+	unsigned long long lost;
+	int fast = 0;
+	int res = 1;
+	int c;
+	long i;
 
-//register our new functions as the implementations of the syscalls
-static struct fuse_operations hello_oper = {
-    .getattr	= cs1550_getattr,
-    .readdir	= cs1550_readdir,
-    .mkdir	= cs1550_mkdir,
-	.rmdir = cs1550_rmdir,
-    .read	= cs1550_read,
-    .write	= cs1550_write,
-	.mknod	= cs1550_mknod,
-	.unlink = cs1550_unlink,
-	.truncate = cs1550_truncate,
-	.flush = cs1550_flush,
-	.open	= cs1550_open,
-};
+	if(parse_options(&args) != 0) {
+		return 1;
+	}
+	argc = args.argc;
+	argv = args.argv;
+	while((c = getopt(argc, argv, "fi:m:")) != -1) {
+		switch(c) {
+		case 'f':
+			fast = 1;
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 'm':
+			mountpoint = optarg;
+			break;
+		default:
+			image = mountpoint = NULL;
+			optind = argc;
+			break;
+		}
+	}
+	if(optind != argc - 1 || (image == NULL) == (mountpoint == NULL) || num_members > 0) {
+		fprintf(stderr, "usage: %s [-f] (-i new-image | -m mountpoint) trace\n", argv[0]);
+		fuse_opt_free_args(&args);
+		return 1;
+	}
+
+	long count = load_trace(argv[optind], &ops, &lost);
+	if(count != -1) {
+		if(mountpoint != NULL) {
+			res = (replay_run(ops, count, mountpoint, fast, lost) == 0) ? 0 : 1;
+		}
+		else if(replay_image(image) == 0) {
+			image_path = image;
+			if(trace_file != NULL) {
+				trace_operations(&hello_oper);
+				trace_start();
+			}
+			if(mount_image() == -1) {
+				fprintf(stderr, "%s could not be mounted\n", image);
+			}
+			else {
+				res = (replay_run(ops, count, NULL, fast, lost) == 0) ? 0 : 1;
+				unmount_image();
+			}
+			if(trace_file != NULL) {
+				trace_finish();
+			}
+		}
+		for(i = 0; i < count; i++) {
+			free(ops[i].path);
+		}
+		free(ops);
+	}
+	if(trace_file != NULL) {
+		fclose(trace_file);
+	}
+	fuse_opt_free_args(&args);
+	return res;
+}
+#endif
 
-//Don't change this.
+/*
+ * parses the mount options and mounts through the path API, or the
+ * low-level one with CS1550_LOWLEVEL; CS1550_REPLAY builds replay a trace
+ * instead
+ */
 int main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
-}
\ No newline at end of file
+#ifdef CS1550_REPLAY
+	return replay_main(argc, argv);
+#else
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res;
+
+	//-o durability=none|metadata|full, images=, stripe=, trace=
+	if(parse_options(&args) != 0) {
+		return 1;
+	}
+#ifdef CS1550_LOWLEVEL
+	res = ll_main(&args);
+#else
+	if(trace_file != NULL) {
+		trace_operations(&hello_oper);
+	}
+	res = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	if(trace_file != NULL) {
+		fclose(trace_file);
+	}
+#endif
+	fuse_opt_free_args(&args);
+	return res;
+#endif
+}